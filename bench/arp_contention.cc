@@ -0,0 +1,248 @@
+/*
+ * ARP table contention benchmark: many threads looking neighbours up while a
+ * few keep learning them, against the shared -w table (Shared_ARP) and against
+ * a plain ARP_Cache behind a mutex, which is what we'd have without it.
+ *
+ *   make bench/arp_contention
+ *   bench/arp_contention [-r readers] [-w writers] [-t seconds] [-n hosts]
+ *
+ * Writers mostly re-learn hosts we already know (as every packet does), now
+ * and then with a new MAC, and sometimes add a host we haven't seen, so the
+ * table keeps growing under the readers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "twig-arp.h"
+#include "twig-arp-shared.h"
+#include "twig-clock.h"
+
+struct Thread_Result {
+    uint64_t ops;
+    uint64_t hits;
+    uint64_t retries;
+    char pad[40]; // one per cache line, they're written in the loop
+};
+
+static std::atomic<bool> running;
+static std::atomic<uint32_t> next_new_host;
+static int hosts = 1000;
+
+static inline uint32_t xorshift(uint32_t *s)
+{
+	uint32_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *s = x;
+}
+
+static inline void host_ip(uint32_t n, u_char *ip)
+{
+	ip[0] = 10;
+	ip[1] = n >> 16;
+	ip[2] = n >> 8;
+	ip[3] = n;
+}
+
+static inline void host_mac(uint32_t n, uint32_t gen, u_char *mac)
+{
+	mac[0] = 0x02;
+	mac[1] = gen;
+	mac[2] = n >> 24;
+	mac[3] = n >> 16;
+	mac[4] = n >> 8;
+	mac[5] = n;
+}
+
+// What a writer does next: 0 = seen again, 1 = new MAC, 2 = new host
+static inline int writer_op(uint32_t *seed, uint32_t *n, uint32_t *gen)
+{
+	uint32_t r = xorshift(seed);
+	*n = r % hosts;
+	*gen = 0;
+	if (r % 100 == 0) {
+		*n = next_new_host.fetch_add(1, std::memory_order_relaxed);
+		return 2;
+	}
+	if (r % 100 < 10) {
+		*gen = r >> 24;
+		return 1;
+	}
+	return 0;
+}
+
+static void shared_reader(Shared_ARP *t, Thread_Result *res, uint32_t seed)
+{
+	u_char ip[4], mac[6];
+	uint32_t key;
+	while (running.load(std::memory_order_relaxed)) {
+		for (int i = 0; i < 256; i++) {
+			host_ip(xorshift(&seed) % hosts, ip);
+			memcpy(&key, ip, 4);
+			res->hits += t->lookup(key, mac, &res->retries);
+		}
+		res->ops += 256;
+	}
+}
+
+static void shared_writer(Shared_ARP *t, Thread_Result *res, uint32_t seed)
+{
+	u_char ip[4], mac[6];
+	uint32_t key, n, gen;
+	while (running.load(std::memory_order_relaxed)) {
+		loop_clock.refresh();
+		for (int i = 0; i < 256; i++) {
+			writer_op(&seed, &n, &gen);
+			host_ip(n, ip);
+			host_mac(n, gen, mac);
+			memcpy(&key, ip, 4);
+			t->learn(key, mac, loop_clock.mono_sec, &res->retries);
+		}
+		res->ops += 256;
+	}
+}
+
+static void locked_reader(ARP_Cache *c, std::mutex *m, Thread_Result *res, uint32_t seed)
+{
+	u_char ip[4], mac[6];
+	while (running.load(std::memory_order_relaxed)) {
+		for (int i = 0; i < 256; i++) {
+			host_ip(xorshift(&seed) % hosts, ip);
+			std::lock_guard<std::mutex> hold(*m);
+			const ARP_Entry *e = c->lookup(ip);
+			if (e) {
+				memcpy(mac, e->mac, 6);
+				res->hits++;
+			}
+		}
+		res->ops += 256;
+	}
+}
+
+static void locked_writer(ARP_Cache *c, std::mutex *m, Thread_Result *res, uint32_t seed)
+{
+	u_char ip[4], mac[6];
+	uint32_t n, gen;
+	while (running.load(std::memory_order_relaxed)) {
+		loop_clock.refresh();
+		for (int i = 0; i < 256; i++) {
+			writer_op(&seed, &n, &gen);
+			host_ip(n, ip);
+			host_mac(n, gen, mac);
+			std::lock_guard<std::mutex> hold(*m);
+			c->add_entry(mac, ip);
+		}
+		res->ops += 256;
+	}
+}
+
+static void report(const char *name, const std::vector<Thread_Result> &r, int readers, double secs, bool shared)
+{
+	uint64_t rops = 0, hits = 0, retries = 0, wops = 0, probes = 0;
+	for (int i = 0; i < (int)r.size(); i++) {
+		if (i < readers) {
+			rops += r[i].ops;
+			hits += r[i].hits;
+			retries += r[i].retries;
+		} else {
+			wops += r[i].ops;
+			probes += r[i].retries;
+		}
+	}
+	printf("### %s ###\n", name);
+	printf("%-20s %.2f M/s (%.1f%% hits", "lookups", rops / secs / 1e6, rops ? 100.0 * hits / rops : 0.0);
+	if (shared)
+		printf(", %" PRIu64 " seqlock retries", retries);
+	printf(")\n");
+	printf("%-20s %.2f M/s\n", "learns", wops / secs / 1e6);
+	if (probes)
+		printf("%-20s avg=%.2f\n", "learn probe length", wops ? (double)probes / wops : 0.0);
+}
+
+static void run(bool shared, int readers, int writers, int seconds)
+{
+	Shared_ARP table;
+	ARP_Cache cache;
+	std::mutex lock;
+	u_char ip[4], mac[6];
+	uint32_t key;
+
+	loop_clock.refresh();
+	for (int n = 0; n < hosts; n++) {
+		host_ip(n, ip);
+		host_mac(n, 0, mac);
+		memcpy(&key, ip, 4);
+		if (shared)
+			table.learn(key, mac, loop_clock.mono_sec);
+		else
+			cache.add_entry(mac, ip);
+	}
+	next_new_host = hosts;
+
+	std::vector<Thread_Result> results(readers + writers);
+	memset(results.data(), 0, results.size() * sizeof(Thread_Result));
+	std::vector<std::thread> threads;
+	running = true;
+	for (int i = 0; i < readers + writers; i++) {
+		uint32_t seed = 0x9e3779b1u * (i + 1);
+		if (shared && i < readers)
+			threads.push_back(std::thread(shared_reader, &table, &results[i], seed));
+		else if (shared)
+			threads.push_back(std::thread(shared_writer, &table, &results[i], seed));
+		else if (i < readers)
+			threads.push_back(std::thread(locked_reader, &cache, &lock, &results[i], seed));
+		else
+			threads.push_back(std::thread(locked_writer, &cache, &lock, &results[i], seed));
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct timespec ts = { seconds, 0 };
+	nanosleep(&ts, NULL);
+	running = false;
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	report(shared ? "shared (seqlock)" : "mutex", results, readers, secs, shared);
+	if (shared)
+		table.print_stats(stdout);
+	else
+		cache.print_stats(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int readers = 8, writers = 2, seconds = 2;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+			readers = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-w") == 0)
+			writers = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			seconds = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			hosts = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [-r readers] [-w writers] [-t seconds] [-n hosts]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (readers < 0 || writers < 0 || readers + writers == 0 || seconds <= 0 || hosts <= 0) {
+		fprintf(stderr, "%s: need at least one thread, a positive time and host count\n", argv[0]);
+		exit(1);
+	}
+
+	printf("%d readers, %d writers, %d hosts, %ds each\n", readers, writers, hosts, seconds);
+	run(true, readers, writers, seconds);
+	run(false, readers, writers, seconds);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Every checksum kernel against the 16-bit reference loop.
+ *
+ * For lengths 0-300 at offsets 0-15, with random bytes and with all 0xFF
+ * (which carries as much as data can), starting from sums that are zero,
+ * small, or big enough to carry themselves:
+ *   - folded, a kernel agrees with csum_partial_scalar16(),
+ *   - unfolded, it fits in 32 bits (see twig-checksum.h),
+ *   - two calls chained through the sum agree with one call over both pieces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "twig-checksum.h"
+
+#define MAX_LEN 300
+#define MAX_OFFSET 16
+
+static int failures;
+
+// Ones-complement value of sum in 16 bits, not inverted (csum_fold() is ~ of this)
+static uint64_t fold16(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+// What a kernel should come to: the incoming sum plus the plain 16-bit sum of the bytes
+static uint64_t reference(const void *buf, size_t len, uint64_t sum)
+{
+	return fold16(fold16(sum) + csum_partial_scalar16(buf, len, 0));
+}
+
+static void fail(const Checksum_Kernel &k, const char *what, const char *data, size_t off, size_t len, uint64_t sum,
+	uint64_t got, uint64_t want)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "  %s: %s with %s data, offset %zu length %zu sum 0x%" PRIx64 ": got 0x%" PRIx64 ", want 0x%" PRIx64 "\n",
+			k.name, what, data, off, len, sum, got, want);
+}
+
+int main()
+{
+	static u_char random_data[MAX_OFFSET + MAX_LEN], ones[MAX_OFFSET + MAX_LEN];
+	srand(1);
+	for (size_t i = 0; i < sizeof(random_data); i++)
+		random_data[i] = rand();
+	memset(ones, 0xFF, sizeof(ones));
+
+	const uint64_t sums[] = { 0, 1, 0xFFFF, 0x1FFFE, 0xFFFFFFFF, 0x100000000ull, 0xFFFFFFFFFFFFull, 0xFFFFFFFFFFFFFFFFull };
+	const struct { const char *name; const u_char *buf; } inputs[] = { { "random", random_data }, { "0xff", ones } };
+
+	for (int k = 0; k < checksum_kernel_count; k++) {
+		const Checksum_Kernel &kern = checksum_kernels[k];
+		if (!kern.supported()) {
+			printf("%-12s not supported here, skipped\n", kern.name);
+			continue;
+		}
+		int before = failures;
+		for (size_t in = 0; in < sizeof(inputs) / sizeof(inputs[0]); in++) {
+			for (size_t off = 0; off < MAX_OFFSET; off++) {
+				const u_char *buf = inputs[in].buf + off;
+				for (size_t len = 0; len <= MAX_LEN; len++) {
+					for (size_t s = 0; s < sizeof(sums) / sizeof(sums[0]); s++) {
+						uint64_t sum = sums[s];
+						uint64_t want = reference(buf, len, sum);
+
+						uint64_t got = kern.partial(buf, len, sum);
+						if (got >> 32)
+							fail(kern, "unfolded sum past 32 bits", inputs[in].name, off, len, sum, got, 0xFFFFFFFF);
+						if (fold16(got) != want)
+							fail(kern, "folded sum", inputs[in].name, off, len, sum, fold16(got), want);
+
+						// Split at an even point (only the last piece may be odd) and chain the sum through
+						size_t split = (len / 3) & ~(size_t)1;
+						uint64_t chained = kern.partial(buf + split, len - split, kern.partial(buf, split, sum));
+						if (chained >> 32)
+							fail(kern, "chained sum past 32 bits", inputs[in].name, off, len, sum, chained, 0xFFFFFFFF);
+						if (fold16(chained) != want)
+							fail(kern, "chained sum", inputs[in].name, off, len, sum, fold16(chained), want);
+					}
+				}
+			}
+		}
+		printf("%-12s %s\n", kern.name, failures == before ? "ok" : "FAILED");
+	}
+
+	// The reference itself has to keep the same contract, the templates store its kind of sum
+	uint64_t big = csum_partial_scalar16(ones, MAX_LEN, 0xFFFFFFFFFFFFull);
+	if (big >> 32 || fold16(big) != reference(ones, MAX_LEN, 0xFFFFFFFFFFFFull)) {
+		fprintf(stderr, "  scalar16: sum 0x%" PRIx64 " breaks the contract\n", big);
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Reply header templates against a from-scratch checksum.
+ *
+ * Every reply header Header_Cache builds has to checksum to zero, whichever
+ * kernel csum_partial() is and whatever the peer's address is. Addresses near
+ * 172.31.0.255 make the saved sum carry past 32 bits, which is where keeping
+ * it in a uint32_t went wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twig-utils.h"
+#include "twig-checksum.h"
+#include "twig-hdrcache.h"
+
+static int failures;
+
+// A request frame from peer (a.b.c.d) to 172.31.128.1, like the ones in the test captures
+static void make_request(char *frame, const u_char peer[4], u_char type, u_short ident)
+{
+	eth_hdr *eh = (eth_hdr *)frame;
+	IPv4 *ip = (IPv4 *)(frame + sizeof(eth_hdr));
+	const u_char us_mac[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+	u_char peer_mac[6] = { 0x02, 0, 0, 0, 0, 0 };
+	peer_mac[5] = peer[3];
+	peer_mac[4] = peer[2];
+
+	memcpy(eh->dest, us_mac, 6);
+	memcpy(eh->src, peer_mac, 6);
+	eh->type = byteswap16(0x0800);
+	memset(ip, 0, sizeof(*ip));
+	ip->hlen = 0x45;
+	ip->len = byteswap16(84);
+	ip->frag_ident = byteswap16(ident);
+	ip->ttl = 63;
+	ip->type = type;
+	memcpy(ip->src, peer, 4);
+	const u_char us[4] = { 172, 31, 128, 1 };
+	memcpy(ip->dest, us, 4);
+	ip->csum = inet_checksum(ip, sizeof(*ip));
+}
+
+static void check(Header_Cache &cache, const u_char peer[4], u_char type, u_short ip_len)
+{
+	char frame[REPLY_HDR_BYTES];
+	make_request(frame, peer, type, ip_len * 7);
+	cache.turn_around(frame, ip_len);
+
+	const IPv4 *ip = (const IPv4 *)(frame + sizeof(eth_hdr));
+	u_short check = csum_fold(csum_partial_scalar16(ip, sizeof(*ip), 0));
+	if (check != 0 || byteswap16(ip->len) != ip_len || memcmp(ip->dest, peer, 4) != 0) {
+		if (failures++ < 10)
+			fprintf(stderr, "  %u.%u.%u.%u proto %u len %u: checksum 0x%04x doesn't verify\n",
+				peer[0], peer[1], peer[2], peer[3], type, ip_len, byteswap16(ip->csum));
+	}
+}
+
+int main()
+{
+	const u_short lens[] = { 28, 50, 84, 0x1ff, 1500, 0xfeff, 0xffff };
+
+	for (int k = 0; k < checksum_kernel_count; k++) {
+		if (!checksum_kernels[k].supported())
+			continue;
+		csum_partial = checksum_kernels[k].partial;
+		int before = failures;
+
+		// Each pass builds templates (misses) and then reuses them (hits)
+		Header_Cache *cache = new Header_Cache();
+		for (int pass = 0; pass < 2; pass++) {
+			for (int c = 0; c < 256; c++) {
+				for (int d = 0; d < 256; d += (c == 0 ? 1 : 17)) {
+					const u_char peer[4] = { 172, 31, (u_char)c, (u_char)d };
+					for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+						check(*cache, peer, 1, lens[l]);
+						check(*cache, peer, 17, lens[l]);
+					}
+				}
+			}
+			const u_char edge[][4] = { { 255, 255, 255, 255 }, { 172, 31, 0, 254 }, { 172, 31, 0, 255 }, { 0, 0, 0, 0 } };
+			for (size_t e = 0; e < sizeof(edge) / sizeof(edge[0]); e++)
+				for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+					check(*cache, edge[e], 1, lens[l]);
+		}
+		delete cache;
+		printf("%-12s %s\n", checksum_kernels[k].name, failures == before ? "ok" : "FAILED");
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Recompute every checksum in a capture of replies (twig -r's output).
+ *
+ * make check replays a twig-gen capture and runs this over what came out,
+ * so a checksum kernel, the header templates and the RFC 1624 patching all
+ * get checked end to end against the plain 16-bit reference sum.
+ *
+ *   tests/replay_check replies.dmp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <vector>
+#include "twig-utils.h"
+#include "twig-checksum.h"
+
+static bool verifies(const void *buf, size_t len, uint64_t sum = 0)
+{
+	return csum_fold(csum_partial_scalar16(buf, len, sum)) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s replies.dmp\n", argv[0]);
+		exit(1);
+	}
+	FILE *in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		perror(argv[1]);
+		exit(1);
+	}
+
+	pcap_file_header pfh;
+	if (fread(&pfh, sizeof(pfh), 1, in) != 1) {
+		fprintf(stderr, "%s: truncated pcap header\n", argv[1]);
+		exit(1);
+	}
+	bool swapped = pfh.magic != PCAP_MAGIC;
+	if (swapped && byteswap32(pfh.magic) != PCAP_MAGIC) {
+		fprintf(stderr, "%s: invalid magic number: 0x%08x\n", argv[1], pfh.magic);
+		exit(1);
+	}
+
+	uint64_t records = 0, ip = 0, bad_ip = 0, icmp = 0, bad_icmp = 0, udp = 0, bad_udp = 0;
+	std::vector<u_char> frame;
+	pcap_pkthdr pph;
+	while (fread(&pph, sizeof(pph), 1, in) == 1) {
+		uint32_t caplen = swapped ? byteswap32(pph.caplen) : pph.caplen;
+		frame.resize(caplen);
+		if (caplen && fread(frame.data(), caplen, 1, in) != 1) {
+			fprintf(stderr, "%s: truncated record %" PRIu64 "\n", argv[1], records);
+			exit(1);
+		}
+		records++;
+
+		if (caplen < sizeof(eth_hdr) + sizeof(IPv4))
+			continue;
+		const eth_hdr *eh = (const eth_hdr *)frame.data();
+		if (byteswap16(eh->type) != 0x0800)
+			continue;
+		const IPv4 *iph = (const IPv4 *)(frame.data() + sizeof(eth_hdr));
+		size_t hlen = (iph->hlen & 0x0f) * 4;
+		size_t ip_len = byteswap16(iph->len);
+		if (hlen < sizeof(IPv4) || sizeof(eth_hdr) + ip_len > caplen || ip_len < hlen)
+			continue;
+
+		ip++;
+		if (!verifies(iph, hlen)) {
+			if (bad_ip++ < 5) {
+				fprintf(stderr, "record %" PRIu64 ": bad IPv4 header checksum:", records);
+				for (size_t i = 0; i < hlen; i++)
+					fprintf(stderr, "%02x", ((const u_char *)iph)[i]);
+				fprintf(stderr, "\n");
+			}
+		}
+
+		const u_char *l4 = (const u_char *)iph + hlen;
+		size_t l4_len = ip_len - hlen;
+		if (iph->type == 1) {
+			icmp++;
+			if (!verifies(l4, l4_len) && bad_icmp++ < 5)
+				fprintf(stderr, "record %" PRIu64 ": bad ICMP checksum\n", records);
+		} else if (iph->type == 17 && l4_len >= sizeof(UDP)) {
+			const UDP *uh = (const UDP *)l4;
+			if (uh->checksum == 0)
+				continue; // none sent
+			udp++;
+			struct {
+				u_char src[4], dest[4];
+				u_char zero, proto;
+				u_short len;
+			} pseudo;
+			memcpy(pseudo.src, iph->src, 4);
+			memcpy(pseudo.dest, iph->dest, 4);
+			pseudo.zero = 0;
+			pseudo.proto = 17;
+			pseudo.len = byteswap16(l4_len);
+			if (!verifies(l4, l4_len, csum_partial_scalar16(&pseudo, sizeof(pseudo), 0)) && bad_udp++ < 5)
+				fprintf(stderr, "record %" PRIu64 ": bad UDP checksum\n", records);
+		}
+	}
+	fclose(in);
+
+	printf("%" PRIu64 " records: %" PRIu64 "/%" PRIu64 " bad IPv4, %" PRIu64 "/%" PRIu64 " bad ICMP, %" PRIu64 "/%" PRIu64 " bad UDP\n",
+		records, bad_ip, ip, bad_icmp, icmp, bad_udp, udp);
+	if (ip == 0) {
+		fprintf(stderr, "%s: no IPv4 replies to check\n", argv[1]);
+		return 1;
+	}
+	return bad_ip || bad_icmp || bad_udp ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Tail a capture and make sure twig doesn't answer its own replies.
+ *
+ * The replies go on the end of the file being read, so twig reads them back.
+ * A UDP echo from port 7 to port 7 is its own request, and answering it
+ * again grew a file without end; an ICMP echo reply came back as a not_echo
+ * drop. Start twig on an empty capture in each reader/writer mode, append
+ * one of each, and check the file grew by exactly one reply each and the
+ * counters (-S) saw no drops.
+ *
+ *   tests/tail_check [twig]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include "twig-utils.h"
+#include "twig-checksum.h"
+
+#define CAPTURE "tests/tail-test.dmp"
+#define STATS "tests/tail-test.prom"
+
+static size_t make_frame(char *frame, u_char proto, const void *l4, size_t l4_len)
+{
+	eth_hdr *eh = (eth_hdr *)frame;
+	IPv4 *ip = (IPv4 *)(frame + sizeof(eth_hdr));
+	const u_char us_mac[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+	const u_char peer_mac[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+	const u_char us[4] = { 172, 31, 128, 1 };
+	const u_char peer[4] = { 172, 31, 128, 2 };
+
+	memcpy(eh->dest, us_mac, 6);
+	memcpy(eh->src, peer_mac, 6);
+	eh->type = byteswap16(0x0800);
+	memset(ip, 0, sizeof(*ip));
+	ip->hlen = 0x45;
+	ip->len = byteswap16(sizeof(IPv4) + l4_len);
+	ip->frag_ident = byteswap16(1);
+	ip->ttl = 64;
+	ip->type = proto;
+	memcpy(ip->src, peer, 4);
+	memcpy(ip->dest, us, 4);
+	ip->csum = inet_checksum(ip, sizeof(*ip));
+	memcpy(frame + sizeof(eth_hdr) + sizeof(IPv4), l4, l4_len);
+	return sizeof(eth_hdr) + sizeof(IPv4) + l4_len;
+}
+
+static void append(int fd, const char *frame, size_t len)
+{
+	pcap_pkthdr pph;
+	pph.ts_secs = 1;
+	pph.ts_usecs = 0;
+	pph.caplen = pph.len = len;
+	if (write(fd, &pph, sizeof(pph)) != sizeof(pph) || write(fd, frame, len) != (ssize_t)len) {
+		perror(CAPTURE);
+		exit(1);
+	}
+}
+
+// Value of the counter line starting with name in the -S file, or -1 if it isn't there
+static long counter(const char *name)
+{
+	FILE *in = fopen(STATS, "r");
+	if (in == NULL)
+		return -1;
+	char line[256];
+	long value = -1;
+	while (fgets(line, sizeof(line), in))
+		if (strncmp(line, name, strlen(name)) == 0 && line[strlen(name)] == ' ')
+			value = atol(line + strlen(name));
+	fclose(in);
+	return value;
+}
+
+static bool run(const char *twig, const std::vector<const char *> &mode)
+{
+	// A UDP echo from port 7 to port 7 (answering the reply would go on forever) and an ICMP echo
+	char udp_frame[128], icmp_frame[128];
+	char payload[8 + 32];
+	memset(payload, 'x', sizeof(payload));
+	UDP *udp = (UDP *)payload;
+	udp->sport = byteswap16(7);
+	udp->dport = byteswap16(7);
+	udp->len = byteswap16(8 + 18);
+	udp->checksum = 0;
+	size_t udp_len = make_frame(udp_frame, 17, payload, 8 + 18);
+
+	memset(payload, 'y', sizeof(payload));
+	ICMP *icmp = (ICMP *)payload;
+	memset(icmp, 0, sizeof(ICMP));
+	icmp->type = 8;
+	icmp->checksum = inet_checksum(payload, sizeof(payload));
+	size_t icmp_len = make_frame(icmp_frame, 1, payload, sizeof(payload));
+
+	unlink(STATS);
+	int fd = open(CAPTURE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644); // like the shim, twig appends too
+	if (fd < 0) {
+		perror(CAPTURE);
+		exit(1);
+	}
+	pcap_file_header pfh;
+	memset(&pfh, 0, sizeof(pfh));
+	pfh.magic = PCAP_MAGIC;
+	pfh.version_major = PCAP_VERSION_MAJOR;
+	pfh.version_minor = PCAP_VERSION_MINOR;
+	pfh.snaplen = 65535;
+	pfh.linktype = 1;
+	if (write(fd, &pfh, sizeof(pfh)) != sizeof(pfh)) {
+		perror(CAPTURE);
+		exit(1);
+	}
+
+	std::vector<const char *> args;
+	args.push_back(twig);
+	args.push_back("-S");
+	args.push_back(STATS);
+	args.insert(args.end(), mode.begin(), mode.end());
+	args.push_back(CAPTURE);
+	args.push_back(NULL);
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execv(twig, (char *const *)args.data());
+		_exit(127);
+	}
+
+	usleep(300000); // let it get to the tail
+	append(fd, udp_frame, udp_len);
+	append(fd, icmp_frame, icmp_len);
+	close(fd);
+	usleep(1500000); // a runaway loop writes megabytes in this long
+	kill(pid, SIGINT);
+	int status;
+	waitpid(pid, &status, 0);
+
+	std::string name = "twig";
+	for (size_t i = 0; i < mode.size(); i++)
+		name += std::string(" ") + mode[i];
+	struct stat st;
+	stat(CAPTURE, &st);
+	size_t want = sizeof(pfh) + 2 * (sizeof(pcap_pkthdr) + udp_len) + 2 * (sizeof(pcap_pkthdr) + icmp_len);
+	long icmp_replies = counter("twig_replies_total{proto=\"icmp\"}");
+	long udp_replies = counter("twig_replies_total{proto=\"udp\"}");
+	long not_echo = counter("twig_drops_total{reason=\"not_echo\"}");
+	bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && (size_t)st.st_size == want &&
+		icmp_replies == 1 && udp_replies == 1 && not_echo == 0;
+	printf("%-16s %s: %lld bytes (want %zu), replies icmp=%ld udp=%ld, not_echo drops=%ld\n", name.c_str(),
+		ok ? "ok" : "FAILED", (long long)st.st_size, want, icmp_replies, udp_replies, not_echo);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *twig = argc > 1 ? argv[1] : "./twig";
+	std::vector<std::vector<const char *> > modes = {
+		{}, { "-m" }, { "-u" }, { "-b", "0" }, { "-p" }, { "-w", "2" }, { "-u", "-w", "2" },
+	};
+	int failures = 0;
+	for (size_t i = 0; i < modes.size(); i++)
+		if (!run(twig, modes[i]))
+			failures++;
+	unlink(CAPTURE);
+	unlink(STATS);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,397 @@
+/*
+ * twig-gen: write a synthetic capture for twig to chew on.
+ *
+ *   make tools/twig-gen
+ *   tools/twig-gen -n 5000000 -sources 10000 -bad 1 big.dmp
+ *   ./twig -r replies.dmp big.dmp
+ *
+ * Frames are ICMP echo requests, UDP echo and time requests and ARP requests
+ * from a set of peers to twig's address, with valid checksums, in whatever mix
+ * and sizes you ask for. -bad mixes in frames twig has to cope with (bad
+ * checksums, lengths that lie, runts, unknown ports); the pcap records
+ * themselves are always well-formed, so twig reads the whole file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include "twig-utils.h"
+#include "twig-checksum.h"
+
+#define GEN_MAX_PAYLOAD 1472 // keeps every frame inside a 1514-byte Ethernet frame
+#define GEN_HDRS (sizeof(eth_hdr) + sizeof(IPv4) + sizeof(UDP)) // ICMP's header is 8 bytes too
+
+enum { KIND_ICMP, KIND_ECHO, KIND_TIME, KIND_ARP, KIND_COUNT };
+static const char *kind_names[KIND_COUNT] = { "icmp echo", "udp echo", "udp time", "arp" };
+
+enum { BAD_IP_CSUM, BAD_L4_CSUM, BAD_IP_LEN, BAD_RUNT, BAD_VERSION, BAD_PORT, BAD_COUNT };
+static const char *bad_names[BAD_COUNT] = { "bad ip checksum", "bad l4 checksum", "ip length too long",
+	"runt", "bad ip version", "unknown udp port" };
+
+enum Size_Mode { SIZE_FIXED, SIZE_UNIFORM, SIZE_IMIX };
+
+struct Gen_Options {
+    uint64_t frames;
+    int weights[KIND_COUNT];
+    Size_Mode size_mode;
+    int size_min, size_max;
+    uint32_t sources;
+    uint32_t twig_ip;  // host order
+    bool big_endian;   // the file's byte order
+    bool swapped;      // which isn't this machine's
+    double bad_pct;
+    uint32_t seed;
+    uint32_t snaplen;
+    const char *out;
+};
+
+static uint64_t rng_state;
+
+static inline uint32_t rnd()
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] outfile\n", prog);
+	fprintf(stderr, "  -n frames             how many (default 1000000)\n");
+	fprintf(stderr, "  -mix I,E,T,A          weights of ICMP echo, UDP echo, UDP time and ARP (default 40,30,10,20)\n");
+	fprintf(stderr, "  -size fixed:N         ICMP/UDP echo payload bytes, always N\n");
+	fprintf(stderr, "  -size uniform:MIN-MAX   anywhere from MIN to MAX\n");
+	fprintf(stderr, "  -size imix            64/576/1500-byte frames, 7:4:1 (default)\n");
+	fprintf(stderr, "  -sources N            distinct peers (MAC and IP), stresses the ARP cache (default 256)\n");
+	fprintf(stderr, "  -ip A.B.C.D           twig's address, peers count up from .10 of its /16 (default 172.31.128.2)\n");
+	fprintf(stderr, "  -be, -le              byte order of the file (default this machine's)\n");
+	fprintf(stderr, "  -bad PCT              percent of malformed frames (default 0)\n");
+	fprintf(stderr, "  -seed N               random seed (default 1)\n");
+	fprintf(stderr, "  -snaplen N            file snaplen (default 65535)\n");
+	exit(99);
+}
+
+static void parse_args(int argc, char **argv, Gen_Options *o)
+{
+	o->frames = 1000000;
+	int defaults[KIND_COUNT] = { 40, 30, 10, 20 };
+	memcpy(o->weights, defaults, sizeof(defaults));
+	o->size_mode = SIZE_IMIX;
+	o->size_min = o->size_max = 56;
+	o->sources = 256;
+	o->twig_ip = 0xAC1F8002; // 172.31.128.2
+	uint16_t probe = 1;
+	bool little = *(u_char *)&probe == 1;
+	o->big_endian = !little;
+	o->bad_pct = 0;
+	o->seed = 1;
+	o->snaplen = 65535;
+	o->out = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		bool more = i + 1 < argc;
+		if (strcmp(argv[i], "-n") == 0 && more) {
+			o->frames = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-mix") == 0 && more) {
+			if (sscanf(argv[++i], "%d,%d,%d,%d", &o->weights[0], &o->weights[1], &o->weights[2], &o->weights[3]) != 4)
+				usage(argv[0]);
+		} else if (strcmp(argv[i], "-size") == 0 && more) {
+			const char *s = argv[++i];
+			if (sscanf(s, "fixed:%d", &o->size_min) == 1) {
+				o->size_mode = SIZE_FIXED;
+				o->size_max = o->size_min;
+			} else if (sscanf(s, "uniform:%d-%d", &o->size_min, &o->size_max) == 2) {
+				o->size_mode = SIZE_UNIFORM;
+			} else if (strcmp(s, "imix") == 0) {
+				o->size_mode = SIZE_IMIX;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(argv[i], "-sources") == 0 && more) {
+			o->sources = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-ip") == 0 && more) {
+			in_addr a;
+			if (inet_aton(argv[++i], &a) == 0)
+				usage(argv[0]);
+			o->twig_ip = ntohl(a.s_addr);
+		} else if (strcmp(argv[i], "-be") == 0) {
+			o->big_endian = true;
+		} else if (strcmp(argv[i], "-le") == 0) {
+			o->big_endian = false;
+		} else if (strcmp(argv[i], "-bad") == 0 && more) {
+			o->bad_pct = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-seed") == 0 && more) {
+			o->seed = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-snaplen") == 0 && more) {
+			o->snaplen = strtoul(argv[++i], NULL, 10);
+		} else if (argv[i][0] != '-' && o->out == NULL) {
+			o->out = argv[i];
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	o->swapped = o->big_endian == little;
+
+	int total = 0;
+	for (int k = 0; k < KIND_COUNT; k++) {
+		if (o->weights[k] < 0)
+			usage(argv[0]);
+		total += o->weights[k];
+	}
+	if (o->out == NULL || total == 0 || o->sources == 0 || o->sources > 0xFFFFFF)
+		usage(argv[0]);
+	if (o->size_min < 0 || o->size_max < o->size_min || o->size_max > GEN_MAX_PAYLOAD) {
+		fprintf(stderr, "%s: payload sizes have to be 0-%d\n", argv[0], GEN_MAX_PAYLOAD);
+		exit(1);
+	}
+	if (o->bad_pct < 0 || o->bad_pct > 100) {
+		fprintf(stderr, "%s: -bad is a percentage\n", argv[0]);
+		exit(1);
+	}
+}
+
+static int payload_size(const Gen_Options &o)
+{
+	switch (o.size_mode) {
+	case SIZE_FIXED:
+		return o.size_min;
+	case SIZE_UNIFORM:
+		return o.size_min + rnd() % (o.size_max - o.size_min + 1);
+	default: {
+		// The classic simple IMIX, by frame size
+		uint32_t r = rnd() % 12;
+		int frame = r < 7 ? 64 : r < 11 ? 576 : 1514;
+		return frame - GEN_HDRS;
+	}
+	}
+}
+
+static void peer_addrs(const Gen_Options &o, uint32_t peer, u_char *mac, u_char *ip)
+{
+	mac[0] = 0x02; // locally administered
+	mac[1] = 0x00;
+	mac[2] = 0x00;
+	mac[3] = peer >> 16;
+	mac[4] = peer >> 8;
+	mac[5] = peer;
+	uint32_t a = htonl((o.twig_ip & 0xFFFF0000) + 10 + peer);
+	memcpy(ip, &a, 4);
+}
+
+static size_t ip_header(u_char *frame, const u_char *src, const u_char *dst, u_char proto, size_t l4_len, uint16_t ident)
+{
+	IPv4 *ip = (IPv4 *)(frame + sizeof(eth_hdr));
+	ip->hlen = 0x45;
+	ip->vers = 0;
+	ip->len = htons(sizeof(IPv4) + l4_len);
+	ip->frag_ident = htons(ident);
+	ip->frag_offset = htons(0x4000); // don't fragment
+	ip->ttl = 64;
+	ip->type = proto;
+	ip->csum = 0;
+	memcpy(ip->src, src, 4);
+	memcpy(ip->dest, dst, 4);
+	ip->csum = inet_checksum(ip, sizeof(IPv4));
+	return sizeof(eth_hdr) + sizeof(IPv4) + l4_len;
+}
+
+static u_short udp_checksum(const IPv4 *ip, const u_char *udp, size_t len)
+{
+	struct {
+		u_char src[4];
+		u_char dest[4];
+		u_char zero;
+		u_char proto;
+		u_short len;
+	} pseudo;
+	memcpy(pseudo.src, ip->src, 4);
+	memcpy(pseudo.dest, ip->dest, 4);
+	pseudo.zero = 0;
+	pseudo.proto = 0x11;
+	pseudo.len = htons(len);
+	u_short c = csum_fold(csum_partial(udp, len, csum_partial(&pseudo, sizeof(pseudo), 0)));
+	return c == 0 ? 0xFFFF : c;
+}
+
+// Build one frame of the given kind, return its length
+static size_t build_frame(const Gen_Options &o, u_char *frame, int kind, uint64_t n, int bad)
+{
+	u_char twig_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+	u_char twig_ip[4];
+	uint32_t a = htonl(o.twig_ip);
+	memcpy(twig_ip, &a, 4);
+
+	uint32_t peer = rnd() % o.sources;
+	u_char mac[6], ip[4];
+	peer_addrs(o, peer, mac, ip);
+
+	eth_hdr *eh = (eth_hdr *)frame;
+	memcpy(eh->src, mac, 6);
+	u_char *l4 = frame + sizeof(eth_hdr) + sizeof(IPv4);
+	size_t len;
+
+	if (kind == KIND_ARP) {
+		memset(eh->dest, 0xFF, 6);
+		eh->type = htons(0x0806);
+		ARP *arp = (ARP *)(frame + sizeof(eth_hdr));
+		arp->htype = htons(1);
+		arp->ptype = htons(0x0800);
+		arp->hlen = 6;
+		arp->plen = 4;
+		arp->op = htons(1);
+		memcpy(arp->sha, mac, 6);
+		memcpy(arp->spa, ip, 4);
+		memset(arp->tha, 0, 6);
+		memcpy(arp->tpa, twig_ip, 4);
+		len = sizeof(eth_hdr) + sizeof(ARP);
+		memset(frame + len, 0, 60 - len); // padded to the Ethernet minimum, like on the wire
+		return 60;
+	}
+
+	memcpy(eh->dest, twig_mac, 6);
+	eh->type = htons(0x0800);
+	size_t payload = kind == KIND_TIME ? 0 : payload_size(o);
+	u_char *data = l4 + 8;
+	for (size_t i = 0; i < payload; i++)
+		data[i] = rnd();
+
+	if (kind == KIND_ICMP) {
+		ICMP *icmp = (ICMP *)l4;
+		icmp->type = 8;
+		icmp->code = 0;
+		icmp->checksum = 0;
+		icmp->id = htons(peer);
+		icmp->seq = htons(n);
+		len = ip_header(frame, ip, twig_ip, 1, 8 + payload, n);
+		icmp->checksum = inet_checksum(icmp, 8 + payload);
+		if (bad == BAD_L4_CSUM)
+			icmp->checksum ^= 0x5555;
+	} else {
+		UDP *udp = (UDP *)l4;
+		udp->sport = htons(1024 + rnd() % 64000);
+		udp->dport = htons(bad == BAD_PORT ? 9 : kind == KIND_TIME ? 37 : 7);
+		udp->len = htons(8 + payload);
+		udp->checksum = 0;
+		len = ip_header(frame, ip, twig_ip, 17, 8 + payload, n);
+		udp->checksum = udp_checksum((IPv4 *)(frame + sizeof(eth_hdr)), l4, 8 + payload);
+		if (bad == BAD_L4_CSUM)
+			udp->checksum ^= 0x5555;
+	}
+
+	IPv4 *iph = (IPv4 *)(frame + sizeof(eth_hdr));
+	switch (bad) {
+	case BAD_IP_CSUM:
+		iph->csum ^= 0x5555;
+		break;
+	case BAD_IP_LEN: // claims more than was captured
+		iph->len = htons(ntohs(iph->len) + 100);
+		iph->csum = 0;
+		iph->csum = inet_checksum(iph, sizeof(IPv4));
+		break;
+	case BAD_RUNT: // cut off in the middle of the IP header
+		len = sizeof(eth_hdr) + 6;
+		break;
+	case BAD_VERSION:
+		iph->hlen = 0x65;
+		iph->csum = 0;
+		iph->csum = inet_checksum(iph, sizeof(IPv4));
+		break;
+	}
+
+	if (len < 60 && bad != BAD_RUNT) {
+		memset(frame + len, 0, 60 - len);
+		len = 60;
+	}
+	return len;
+}
+
+static inline uint32_t file_order(const Gen_Options &o, uint32_t v)
+{
+	return o.swapped ? byteswap32(v) : v;
+}
+
+int main(int argc, char **argv)
+{
+	Gen_Options o;
+	parse_args(argc, argv, &o);
+	rng_state = 0x9E3779B97F4A7C15ull ^ o.seed;
+	if (rng_state == 0) rng_state = 1;
+
+	FILE *out = fopen(o.out, "wb");
+	if (out == NULL) {
+		perror(o.out);
+		exit(1);
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+	pcap_file_header pfh;
+	pfh.magic = file_order(o, PCAP_MAGIC);
+	pfh.version_major = o.swapped ? byteswap16(PCAP_VERSION_MAJOR) : PCAP_VERSION_MAJOR;
+	pfh.version_minor = o.swapped ? byteswap16(PCAP_VERSION_MINOR) : PCAP_VERSION_MINOR;
+	pfh.thiszone = 0;
+	pfh.sigfigs = 0;
+	pfh.snaplen = file_order(o, o.snaplen);
+	pfh.linktype = file_order(o, 1);
+	fwrite(&pfh, sizeof(pfh), 1, out);
+
+	int total_weight = 0;
+	for (int k = 0; k < KIND_COUNT; k++)
+		total_weight += o.weights[k];
+	uint32_t bad_threshold = (uint32_t)(o.bad_pct / 100.0 * 4294967295.0);
+
+	uint64_t kinds[KIND_COUNT] = { 0 }, bads[BAD_COUNT] = { 0 }, bytes = 0;
+	u_char frame[1600];
+	uint32_t ts = 1700000000, usec = 0;
+
+	for (uint64_t n = 0; n < o.frames; n++) {
+		int r = rnd() % total_weight, kind = 0;
+		while (r >= o.weights[kind]) {
+			r -= o.weights[kind];
+			kind++;
+		}
+		int bad = -1;
+		if (kind != KIND_ARP && o.bad_pct > 0 && rnd() <= bad_threshold) {
+			bad = rnd() % BAD_COUNT;
+			if (bad == BAD_PORT && kind == KIND_ICMP)
+				bad = BAD_IP_CSUM;
+			bads[bad]++;
+		}
+		kinds[kind]++;
+
+		size_t len = build_frame(o, frame, kind, n, bad);
+		size_t caplen = len < o.snaplen ? len : o.snaplen;
+
+		pcap_pkthdr ph;
+		ph.ts_secs = file_order(o, ts);
+		ph.ts_usecs = file_order(o, usec);
+		ph.caplen = file_order(o, caplen);
+		ph.len = file_order(o, len);
+		fwrite(&ph, sizeof(ph), 1, out);
+		fwrite(frame, caplen, 1, out);
+		bytes += sizeof(ph) + caplen;
+
+		usec += 10; // 100k frames a second
+		if (usec >= 1000000) {
+			usec -= 1000000;
+			ts++;
+		}
+	}
+	if (fclose(out) != 0) {
+		perror(o.out);
+		exit(1);
+	}
+
+	fprintf(stderr, "%-20s %" PRIu64 " (%" PRIu64 " bytes, %s endian)\n", "frames", o.frames, bytes + sizeof(pfh),
+		o.big_endian ? "big" : "little");
+	for (int k = 0; k < KIND_COUNT; k++)
+		fprintf(stderr, "%-20s %" PRIu64 "\n", kind_names[k], kinds[k]);
+	for (int b = 0; b < BAD_COUNT; b++)
+		if (bads[b])
+			fprintf(stderr, "%-20s %" PRIu64 "\n", bad_names[b], bads[b]);
+	return 0;
+}
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <mutex>
+#include "twig-arp-shared.h"
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t pack_mac(const u_char *mac)
+{
+	uint64_t m = 0;
+	memcpy(&m, mac, 6); // little-endian hosts keep the bytes in order, and it's only ever unpacked here
+	return m;
+}
+
+static inline void unpack_mac(uint64_t m, u_char *mac)
+{
+	memcpy(mac, &m, 6);
+}
+
+Shared_ARP_Table *Shared_ARP::alloc_table(size_t capacity)
+{
+	Shared_ARP_Table *t = new Shared_ARP_Table;
+	t->capacity = capacity;
+	t->slots = (Shared_ARP_Slot *)aligned_alloc(64, capacity * sizeof(Shared_ARP_Slot));
+	if (t->slots == NULL) {
+		perror("malloc failed for Shared_ARP");
+		exit(1);
+	}
+	memset((void *)t->slots, 0, capacity * sizeof(Shared_ARP_Slot)); // all-zero atomics are valid zeros
+	return t;
+}
+
+Shared_ARP::Shared_ARP() : filled(0), count(0), grows(0)
+{
+	table.store(alloc_table(SARP_INITIAL_CAPACITY), std::memory_order_release);
+}
+
+Shared_ARP::~Shared_ARP()
+{
+	retired.push_back(table.load());
+	for (size_t i = 0; i < retired.size(); i++) {
+		free(retired[i]->slots);
+		delete retired[i];
+	}
+}
+
+uint64_t Shared_ARP::read_slot(const Shared_ARP_Slot &s, uint32_t *ip, uint64_t *retries)
+{
+	// Seqlock read: only trust what we saw if nobody was (or started) writing meanwhile
+	while (true) {
+		uint32_t before = s.seq.load(std::memory_order_acquire);
+		if (!(before & 1)) {
+			*ip = s.ip.load(std::memory_order_relaxed);
+			uint64_t mac = s.mac.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) == before)
+				return mac;
+		}
+		if (retries)
+			(*retries)++;
+		cpu_relax();
+	}
+}
+
+void Shared_ARP::claim(Shared_ARP_Slot &s)
+{
+	while (true) {
+		uint32_t seq = s.seq.load(std::memory_order_relaxed);
+		if (!(seq & 1) && s.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+			break;
+		cpu_relax();
+	}
+	std::atomic_thread_fence(std::memory_order_release); // readers that see our writes see the odd seq
+}
+
+void Shared_ARP::release(Shared_ARP_Slot &s)
+{
+	s.seq.fetch_add(1, std::memory_order_release);
+}
+
+bool Shared_ARP::lookup(uint32_t ip, u_char *mac, uint64_t *retries) const
+{
+	const Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+	size_t mask = t->capacity - 1;
+	for (size_t i = arp_hash(ip) & mask, n = 0; n < t->capacity; i = (i + 1) & mask, n++) {
+		uint32_t slot_ip;
+		uint64_t m = read_slot(t->slots[i], &slot_ip, retries);
+		if (!(m & (SARP_USED | SARP_DEAD)))
+			return false; // end of the probe run
+		if ((m & SARP_USED) && slot_ip == ip) {
+			unpack_mac(m, mac);
+			return true;
+		}
+	}
+	return false;
+}
+
+ARP_Learn Shared_ARP::learn(uint32_t ip, const u_char *mac, uint32_t now_sec, uint64_t *probes)
+{
+	uint64_t want = pack_mac(mac);
+
+	// Known host, same MAC: just say we saw it. No claim, so a concurrent grow() might copy the
+	// old time over it, which only means the timer re-arms a little shorter.
+	{
+		const Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+		size_t mask = t->capacity - 1;
+		for (size_t i = arp_hash(ip) & mask, n = 1; n <= t->capacity; i = (i + 1) & mask, n++) {
+			Shared_ARP_Slot &s = t->slots[i];
+			uint32_t slot_ip;
+			uint64_t m = read_slot(s, &slot_ip, NULL);
+			if (!(m & (SARP_USED | SARP_DEAD)))
+				break;
+			if ((m & SARP_USED) && slot_ip == ip) {
+				if (probes) *probes += n;
+				if ((m & SARP_MAC_MASK) != want)
+					break; // moved to a new MAC, that needs a claim
+				if (s.last_seen.load(std::memory_order_relaxed) != now_sec)
+					s.last_seen.store(now_sec, std::memory_order_relaxed);
+				return ARP_LEARN_SEEN;
+			}
+		}
+	}
+
+	ARP_Learn result;
+	{
+		std::shared_lock<std::shared_mutex> hold(resize_lock);
+		Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+		size_t mask = t->capacity - 1;
+		size_t i = arp_hash(ip) & mask;
+		uint64_t n = 1;
+		while (true) {
+			Shared_ARP_Slot &s = t->slots[i];
+			uint64_t m = s.mac.load(std::memory_order_acquire);
+			if (!(m & (SARP_USED | SARP_DEAD))) {
+				claim(s);
+				if (s.mac.load(std::memory_order_relaxed) & (SARP_USED | SARP_DEAD)) {
+					release(s); // somebody filled it first, look at it again
+					continue;
+				}
+				s.ip.store(ip, std::memory_order_relaxed);
+				s.last_seen.store(now_sec, std::memory_order_relaxed);
+				s.mac.store(want | SARP_USED, std::memory_order_release);
+				release(s);
+				filled.fetch_add(1, std::memory_order_relaxed);
+				count.fetch_add(1, std::memory_order_relaxed);
+				result = ARP_LEARN_NEW;
+				break;
+			}
+			// A filled slot's ip never changes, so it can be compared without a claim
+			if ((m & SARP_USED) && s.ip.load(std::memory_order_relaxed) == ip) {
+				claim(s);
+				if (s.mac.load(std::memory_order_relaxed) & SARP_USED) {
+					s.mac.store(want | SARP_USED, std::memory_order_relaxed);
+					s.last_seen.store(now_sec, std::memory_order_relaxed);
+					release(s);
+					result = ARP_LEARN_UPDATED;
+					break;
+				}
+				release(s); // expired under us, keep going and add it again
+			}
+			i = (i + 1) & mask;
+			n++;
+		}
+		if (probes) *probes += n;
+	}
+
+	if (result == ARP_LEARN_NEW) {
+		Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+		if (filled.load(std::memory_order_relaxed) * 100 > t->capacity * SARP_MAX_LOAD_PCT)
+			grow();
+	}
+	return result;
+}
+
+int Shared_ARP::expire(uint32_t ip, uint32_t timeout, uint32_t now_sec)
+{
+	std::shared_lock<std::shared_mutex> hold(resize_lock);
+	Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+	size_t mask = t->capacity - 1;
+	for (size_t i = arp_hash(ip) & mask, n = 0; n < t->capacity; i = (i + 1) & mask, n++) {
+		Shared_ARP_Slot &s = t->slots[i];
+		uint64_t m = s.mac.load(std::memory_order_acquire);
+		if (!(m & (SARP_USED | SARP_DEAD)))
+			break;
+		if (!(m & SARP_USED) || s.ip.load(std::memory_order_relaxed) != ip)
+			continue;
+
+		uint32_t idle = now_sec - s.last_seen.load(std::memory_order_relaxed);
+		if (idle < timeout)
+			return timeout - idle;
+
+		claim(s);
+		m = s.mac.load(std::memory_order_relaxed);
+		if (!(m & SARP_USED)) {
+			release(s);
+			break;
+		}
+		s.mac.store((m & ~SARP_USED) | SARP_DEAD, std::memory_order_relaxed);
+		release(s);
+		count.fetch_sub(1, std::memory_order_relaxed);
+		return ARP_EXPIRE_DONE;
+	}
+	return ARP_EXPIRE_GONE;
+}
+
+void Shared_ARP::grow()
+{
+	std::unique_lock<std::shared_mutex> hold(resize_lock);
+	Shared_ARP_Table *old = table.load(std::memory_order_relaxed);
+	if (filled.load(std::memory_order_relaxed) * 100 <= old->capacity * SARP_MAX_LOAD_PCT)
+		return; // somebody else already did it
+
+	// Mostly tombstones? Then the same size with them cleared out will do
+	size_t live = count.load(std::memory_order_relaxed);
+	size_t capacity = live * 100 > old->capacity * SARP_MAX_LOAD_PCT / 2 ? old->capacity * 2 : old->capacity;
+
+	Shared_ARP_Table *t = alloc_table(capacity);
+	size_t mask = capacity - 1;
+	for (size_t j = 0; j < old->capacity; j++) {
+		Shared_ARP_Slot &o = old->slots[j];
+		uint64_t m = o.mac.load(std::memory_order_relaxed);
+		if (!(m & SARP_USED))
+			continue;
+		uint32_t ip = o.ip.load(std::memory_order_relaxed);
+		size_t i = arp_hash(ip) & mask;
+		while (t->slots[i].mac.load(std::memory_order_relaxed) & SARP_USED)
+			i = (i + 1) & mask;
+		t->slots[i].ip.store(ip, std::memory_order_relaxed);
+		t->slots[i].mac.store(m, std::memory_order_relaxed);
+		t->slots[i].last_seen.store(o.last_seen.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	filled.store(live, std::memory_order_relaxed);
+	table.store(t, std::memory_order_release);
+	retired.push_back(old);
+	grows.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Shared_ARP::print(FILE *out, const Loop_Clock &clock) const
+{
+	const Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+	fprintf(out, "ARP Cache:\n");
+	for (size_t i = 0; i < t->capacity; i++) {
+		uint32_t ip;
+		uint64_t m = read_slot(t->slots[i], &ip, NULL);
+		if (!(m & SARP_USED))
+			continue;
+		u_char mac[6];
+		unpack_mac(m, mac);
+		const u_char *a = (const u_char *)&ip;
+		time_t seen = clock.to_wall(t->slots[i].last_seen.load(std::memory_order_relaxed));
+		fprintf(out, "\tMAC: %02x:%02x:%02x:%02x:%02x:%02x\tIP: %d.%d.%d.%d\n",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], a[0], a[1], a[2], a[3]);
+		fprintf(out, "\tLast seen: %s", ctime(&seen));
+	}
+}
+
+void Shared_ARP::print_stats(FILE *out) const
+{
+	const Shared_ARP_Table *t = table.load(std::memory_order_acquire);
+	size_t n = count.load(std::memory_order_relaxed);
+	fprintf(out, "%-20s %zu/%zu (%.1f%% full, %zu tombstones, grew %" PRIu64 " times, shared)\n", "arp entries",
+		n, t->capacity, 100.0 * n / t->capacity, filled.load(std::memory_order_relaxed) - n,
+		grows.load(std::memory_order_relaxed));
+}
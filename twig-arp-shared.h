@@ -0,0 +1,99 @@
+#ifndef TWIG_ARP_SHARED_H
+#define TWIG_ARP_SHARED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <atomic>
+#include <shared_mutex>
+#include <vector>
+#include "twig-clock.h"
+
+/*
+ * ARP table that several threads can use at once (-w).
+ *
+ * Same layout idea as ARP_Cache (open addressing, linear probing, keyed on
+ * the IPv4 address) but every slot carries a sequence number:
+ *
+ *  - Lookups never lock or write anything shared. They read a slot's
+ *    sequence, the slot, then the sequence again, and retry if it was odd
+ *    (a writer is in there) or changed.
+ *  - Learners claim just the slot they write, by CASing its sequence from
+ *    even to odd, so threads learning different hosts don't wait on each
+ *    other. Seeing a known host with the same MAC again (nearly every packet)
+ *    is a single relaxed store to last_seen with no claim at all.
+ *  - Deleting leaves a tombstone rather than shifting entries around under
+ *    the readers' feet, and a slot is only ever filled once, so two threads
+ *    learning the same host always race for the same slot.
+ *  - Growing (or clearing out tombstones) copies into a new table while the
+ *    learners are held off by resize_lock, which they otherwise only share.
+ *    Readers may still be walking the old table, so it's retired rather
+ *    than freed, and freed with the whole table. Tables double, so the
+ *    retired ones never add up to more than the live one.
+ */
+
+#define SARP_INITIAL_CAPACITY 1024
+#define SARP_MAX_LOAD_PCT 70 // counting tombstones
+
+// mac word: low 48 bits are the MAC, the top bits say what the slot holds
+#define SARP_USED (1ull << 63)
+#define SARP_DEAD (1ull << 62)
+#define SARP_MAC_MASK ((1ull << 48) - 1)
+
+enum ARP_Learn { ARP_LEARN_SEEN, ARP_LEARN_UPDATED, ARP_LEARN_NEW };
+enum ARP_Expire { ARP_EXPIRE_GONE = -2, ARP_EXPIRE_DONE = -1 }; // otherwise seconds left
+
+inline uint32_t arp_hash(uint32_t ip)
+{
+    // Neighbours usually differ only in the last octet or two, so mix every bit
+    // into every other one (murmur3 finalizer) before masking
+    ip ^= ip >> 16;
+    ip *= 0x85EBCA6Bu;
+    ip ^= ip >> 13;
+    ip *= 0xC2B2AE35u;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+struct alignas(32) Shared_ARP_Slot {
+    std::atomic<uint32_t> seq;       // odd while a writer has the slot
+    std::atomic<uint32_t> ip;        // as the 4 bytes sit in the packet
+    std::atomic<uint64_t> mac;       // MAC plus SARP_USED/SARP_DEAD
+    std::atomic<uint32_t> last_seen; // loop clock seconds of whoever saw it last
+};
+
+struct Shared_ARP_Table {
+    size_t capacity; // power of two
+    Shared_ARP_Slot *slots;
+};
+
+struct Shared_ARP {
+    std::atomic<Shared_ARP_Table *> table;
+    std::shared_mutex resize_lock;   // learners share it, grow() takes it alone
+    std::atomic<size_t> filled;      // slots ever filled in this table (entries + tombstones)
+    std::atomic<size_t> count;       // entries
+    std::atomic<uint64_t> grows;
+    std::vector<Shared_ARP_Table *> retired;
+
+    Shared_ARP();
+    ~Shared_ARP();
+
+    // Lock-free. Copies the MAC out; retries counts how often a writer got in the way.
+    bool lookup(uint32_t ip, u_char *mac, uint64_t *retries = NULL) const;
+    ARP_Learn learn(uint32_t ip, const u_char *mac, uint32_t now_sec, uint64_t *probes = NULL);
+    // Drop the entry if it hasn't been seen for timeout seconds, else say how long it has left
+    int expire(uint32_t ip, uint32_t timeout, uint32_t now_sec);
+
+    void print(FILE *out, const Loop_Clock &clock) const;
+    void print_stats(FILE *out) const;
+
+private:
+    static Shared_ARP_Table *alloc_table(size_t capacity);
+    static uint64_t read_slot(const Shared_ARP_Slot &s, uint32_t *ip, uint64_t *retries);
+    static void claim(Shared_ARP_Slot &s);
+    static void release(Shared_ARP_Slot &s);
+    void grow();
+};
+
+#endif
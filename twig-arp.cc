@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "twig-arp.h"
+#include "twig-clock.h"
+#include "twig-metrics.h"
+
+static ARP_Entry *alloc_slots(size_t n)
+{
+	ARP_Entry *slots = (ARP_Entry *)aligned_alloc(64, n * sizeof(ARP_Entry));
+	if (slots == NULL) {
+		perror("malloc failed for ARP_Cache");
+		exit(1);
+	}
+	memset(slots, 0, n * sizeof(ARP_Entry));
+	return slots;
+}
+
+ARP_Cache::ARP_Cache() : capacity(ARP_INITIAL_CAPACITY), count(0),
+	lookups(0), probes(0), max_probe(0), inserts(0), updates(0), grows(0), expiries(0), refreshes(0),
+	wheel(NULL), timeout(ARP_TIMEOUT_SEC), shared(NULL)
+{
+	slots = alloc_slots(capacity);
+}
+
+ARP_Cache::~ARP_Cache()
+{
+	for (size_t i = 0; i < timer_chunks.size(); i++) {
+		for (int j = 0; j < ARP_TIMER_CHUNK; j++)
+			if (wheel) wheel->cancel(&timer_chunks[i][j]);
+		delete[] timer_chunks[i];
+	}
+	free(slots);
+}
+
+static void arp_timer(Timer *t)
+{
+	((ARP_Cache *)t->arg)->timer_fired(t);
+}
+
+void ARP_Cache::set_aging(Timer_Wheel *timers, uint32_t timeout_sec)
+{
+	wheel = timers;
+	timeout = timeout_sec;
+}
+
+Timer *ARP_Cache::get_timer()
+{
+	if (free_timers.empty()) {
+		// Timers sit on the wheel's lists, so they can't live in the (moving) slot array
+		Timer *chunk = new Timer[ARP_TIMER_CHUNK];
+		timer_chunks.push_back(chunk);
+		for (int i = ARP_TIMER_CHUNK - 1; i >= 0; i--)
+			free_timers.push_back(&chunk[i]);
+	}
+	Timer *t = free_timers.back();
+	free_timers.pop_back();
+	t->fn = arp_timer;
+	t->arg = this;
+	return t;
+}
+
+void ARP_Cache::timer_fired(Timer *t)
+{
+	if (shared) {
+		int left = shared->expire((uint32_t)t->key, timeout, loop_clock.mono_sec);
+		if (left < 0) {
+			free_timers.push_back(t);
+			if (left == ARP_EXPIRE_DONE) {
+				expiries++;
+				metric_add(metrics().arp_evictions);
+			}
+			return;
+		}
+		wheel->add(t, loop_clock.mono_ns + (uint64_t)left * 1000000000ull);
+		refreshes++;
+		return;
+	}
+
+	ARP_Entry *e = find((uint32_t)t->key);
+	if (e == NULL) {
+		free_timers.push_back(t);
+		return;
+	}
+
+	uint32_t idle = loop_clock.mono_sec - e->last_seen;
+	if (idle >= timeout) {
+		remove(e);
+		free_timers.push_back(t);
+		expiries++;
+		metric_add(metrics().arp_evictions);
+		return;
+	}
+
+	// Seen since the timer was set, come back when the rest of the timeout is up
+	wheel->add(t, loop_clock.mono_ns + (uint64_t)(timeout - idle) * 1000000000ull);
+	refreshes++;
+}
+
+void ARP_Cache::note_probe(uint64_t n)
+{
+	lookups++;
+	probes += n;
+	if (n > max_probe) max_probe = n;
+}
+
+void ARP_Cache::add_entry(const u_char *mac, const u_char *ip)
+{
+	uint32_t key;
+	memcpy(&key, ip, sizeof(key));
+
+	if (shared) {
+		uint64_t n = 0;
+		ARP_Learn how = shared->learn(key, mac, loop_clock.mono_sec, &n);
+		note_probe(n);
+		if (how != ARP_LEARN_NEW) {
+			updates++;
+			return;
+		}
+		// Whoever added it owns its timer
+		inserts++;
+		metric_add(metrics().arp_learns);
+		if (wheel) {
+			Timer *t = get_timer();
+			t->key = key;
+			wheel->add(t, loop_clock.mono_ns + (uint64_t)timeout * 1000000000ull);
+		}
+		return;
+	}
+
+	size_t i = slot_for(key);
+	uint64_t n = 1;
+	while (slots[i].used) {
+		if (slots[i].ip == key) {
+			// Already know this one, the MAC may have changed though
+			memcpy(slots[i].mac, mac, sizeof(slots[i].mac));
+			slots[i].last_seen = loop_clock.mono_sec; // Update the last seen time (the timer notices later)
+			updates++;
+			note_probe(n);
+			return;
+		}
+		i = (i + 1) & (capacity - 1);
+		n++;
+	}
+	note_probe(n);
+
+	// If it doesn't exist, add a new entry
+	slots[i].ip = key;
+	memcpy(slots[i].mac, mac, sizeof(slots[i].mac));
+	slots[i].used = 1;
+	slots[i].last_seen = loop_clock.mono_sec; // Set the last seen time to the current time
+	count++;
+	inserts++;
+	metric_add(metrics().arp_learns);
+
+	if (wheel) {
+		Timer *t = get_timer();
+		t->key = key;
+		wheel->add(t, loop_clock.mono_ns + (uint64_t)timeout * 1000000000ull);
+	}
+
+	if (count * 100 > capacity * ARP_MAX_LOAD_PCT)
+		grow();
+}
+
+const ARP_Entry *ARP_Cache::lookup(const u_char *ip)
+{
+	uint32_t key;
+	memcpy(&key, ip, sizeof(key));
+
+	if (shared) {
+		note_probe(1);
+		if (!shared->lookup(key, scratch.mac))
+			return NULL;
+		scratch.ip = key;
+		scratch.used = 1;
+		return &scratch;
+	}
+
+	size_t i = slot_for(key);
+	uint64_t n = 1;
+	while (slots[i].used) {
+		if (slots[i].ip == key) {
+			note_probe(n);
+			return &slots[i];
+		}
+		i = (i + 1) & (capacity - 1);
+		n++;
+	}
+	note_probe(n);
+	return NULL;
+}
+
+ARP_Entry *ARP_Cache::find(uint32_t key)
+{
+	size_t i = slot_for(key);
+	while (slots[i].used) {
+		if (slots[i].ip == key)
+			return &slots[i];
+		i = (i + 1) & (capacity - 1);
+	}
+	return NULL;
+}
+
+void ARP_Cache::remove(ARP_Entry *e)
+{
+	// Backward shift deletion: pull later entries of the probe run into the hole so
+	// lookups never have to skip over tombstones
+	size_t hole = e - slots;
+	size_t i = hole;
+	while (true) {
+		i = (i + 1) & (capacity - 1);
+		if (!slots[i].used)
+			break;
+		size_t home = slot_for(slots[i].ip);
+		// Move it if its home slot isn't between the hole and where it sits now
+		if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+			slots[hole] = slots[i];
+			hole = i;
+		}
+	}
+	memset(&slots[hole], 0, sizeof(slots[hole]));
+	count--;
+}
+
+void ARP_Cache::grow()
+{
+	ARP_Entry *old = slots;
+	size_t old_capacity = capacity;
+
+	capacity *= 2;
+	slots = alloc_slots(capacity);
+	for (size_t j = 0; j < old_capacity; j++) {
+		if (!old[j].used)
+			continue;
+		size_t i = slot_for(old[j].ip);
+		while (slots[i].used)
+			i = (i + 1) & (capacity - 1);
+		slots[i] = old[j];
+	}
+	free(old);
+	grows++;
+}
+
+void ARP_Cache::print(FILE *out) const
+{
+	if (shared) {
+		shared->print(out, loop_clock);
+		return;
+	}
+	fprintf(out, "ARP Cache:\n");
+	for (size_t i = 0; i < capacity; i++) {
+		if (!slots[i].used)
+			continue;
+		const ARP_Entry &e = slots[i];
+		const u_char *ip = (const u_char *)&e.ip;
+		time_t seen = loop_clock.to_wall(e.last_seen);
+		fprintf(out, "\tMAC: %02x:%02x:%02x:%02x:%02x:%02x\tIP: %d.%d.%d.%d\n",
+			e.mac[0], e.mac[1], e.mac[2], e.mac[3], e.mac[4], e.mac[5],
+			ip[0], ip[1], ip[2], ip[3]);
+		fprintf(out, "\tLast seen: %s", ctime(&seen));
+	}
+}
+
+void ARP_Cache::print_stats(FILE *out) const
+{
+	if (shared)
+		shared->print_stats(out);
+	else
+		fprintf(out, "%-20s %zu/%zu (%.1f%% full, grew %" PRIu64 " times)\n", "arp entries",
+			count, capacity, 100.0 * count / capacity, grows);
+	fprintf(out, "%-20s %" PRIu64 " inserts, %" PRIu64 " updates\n", "arp learns", inserts, updates);
+	fprintf(out, "%-20s %" PRIu64 " expired, %" PRIu64 " refreshed (timeout %us)\n", "arp aging", expiries, refreshes, timeout);
+	fprintf(out, "%-20s avg=%.2f max=%" PRIu64 "\n", "arp probe length",
+		lookups ? (double)probes / lookups : 0.0, max_probe);
+}
@@ -0,0 +1,87 @@
+#ifndef TWIG_ARP_H
+#define TWIG_ARP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+#include "twig-timer.h"
+#include "twig-arp-shared.h"
+
+/*
+ * ARP cache: open-addressing hash table keyed on IPv4 address.
+ *
+ * Linear probing over a power-of-two array of 16-byte entries (four to a cache
+ * line), so a lookup is a hash, usually one cache miss and a compare. The table
+ * doubles when it gets 70% full, so there's no limit on how many neighbours we
+ * learn.
+ *
+ * Aging: every entry has one timer on the wheel, set for timeout seconds after
+ * it was learned. Seeing the host again only bumps last_seen (no wheel work on
+ * the hot path); when the timer goes off it either re-arms for the rest of the
+ * timeout (refresh) or drops the entry (expiry).
+ *
+ * Shared mode (set_shared): the entries live in a Shared_ARP that other
+ * threads learn into too, and this cache only keeps the stats and the timers
+ * for the hosts it learned first.
+ */
+
+#define ARP_INITIAL_CAPACITY 256
+#define ARP_MAX_LOAD_PCT 70
+#define ARP_TIMEOUT_SEC 300
+#define ARP_TIMER_CHUNK 256
+
+struct ARP_Entry {
+    uint32_t ip;        // IP address, as the 4 bytes sit in the packet
+    u_char mac[6];      // MAC address
+    uint16_t used;      // slot holds an entry (0.0.0.0 is a real source address)
+    uint32_t last_seen; // Last seen time (loop clock monotonic seconds)
+};
+
+struct ARP_Cache {
+    ARP_Entry *slots;
+    size_t capacity;    // always a power of two
+    size_t count;       // Number of entries in the cache
+
+    // stats
+    uint64_t lookups;   // add_entry() + lookup() calls
+    uint64_t probes;    // slots looked at by those calls
+    uint64_t max_probe; // longest probe sequence seen
+    uint64_t inserts;
+    uint64_t updates;
+    uint64_t grows;
+    uint64_t expiries;
+    uint64_t refreshes; // timer went off but the entry had been seen since
+
+    // aging
+    Timer_Wheel *wheel;  // NULL = entries never expire
+    uint32_t timeout;    // seconds
+    std::vector<Timer *> free_timers;
+    std::vector<Timer *> timer_chunks;
+
+    Shared_ARP *shared;  // NULL = entries live in slots
+    ARP_Entry scratch;   // what lookup() hands back in shared mode
+
+    ARP_Cache();
+    ~ARP_Cache();
+
+    void add_entry(const u_char *mac, const u_char *ip); // learn (or refresh) ip -> mac
+    const ARP_Entry *lookup(const u_char *ip);
+    void set_aging(Timer_Wheel *timers, uint32_t timeout_sec);
+    void timer_fired(Timer *t);
+    void set_shared(Shared_ARP *table) { shared = table; }
+
+    void print(FILE *out) const;
+    void print_stats(FILE *out) const;
+
+private:
+    size_t slot_for(uint32_t ip) const { return arp_hash(ip) & (capacity - 1); }
+    void grow();
+    void note_probe(uint64_t n);
+    ARP_Entry *find(uint32_t key);
+    void remove(ARP_Entry *e);
+    Timer *get_timer();
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utility>
+#include <algorithm>
+#include "twig-batch.h"
+#include "twig-stats.h"
+#include "twig-latency.h"
+#include "twig-metrics.h"
+
+void Own_Writes::add(uint64_t start, uint64_t end)
+{
+	std::lock_guard<std::mutex> hold(lock);
+	added.push_back(Own_Range{start, end});
+	version.fetch_add(1, std::memory_order_release);
+}
+
+Own_Record Own_Writes::classify(uint64_t start, uint64_t end)
+{
+	// Writers note their range before they lower the floor, so look at the floors first
+	for (size_t i = 0; i < writers.size(); i++) {
+		uint64_t floor = writers[i]->writing_floor.load(std::memory_order_acquire);
+		if (floor && end > floor)
+			return OWN_WRITING;
+	}
+
+	if (version.load(std::memory_order_acquire) != seen_version) {
+		std::lock_guard<std::mutex> hold(lock);
+		seen_version = version.load(std::memory_order_relaxed);
+		// Two writers can note theirs out of order, keep ahead sorted
+		for (size_t i = 0; i < added.size(); i++) {
+			auto by_start = [](const Own_Range &a, const Own_Range &b) { return a.start < b.start; };
+			ahead.insert(std::upper_bound(ahead.begin(), ahead.end(), added[i], by_start), added[i]);
+		}
+		added.clear();
+	}
+	while (!ahead.empty() && ahead.front().end <= start)
+		ahead.pop_front();
+	return !ahead.empty() && ahead.front().start <= start ? OWN_YES : OWN_NOT;
+}
+
+void Reply_Batch::init(int out_fd, Buffer_Pool *buffers, uint64_t deadline_us, bool want_uring, Own_Writes *note)
+{
+	fd = out_fd;
+	pool = buffers;
+	deadline_ns = deadline_us * 1000;
+	held.reserve(BATCH_MAX_IOV / 5);
+	ring = want_uring ? uring_open() : NULL;
+	if (ring)
+		sent_held.reserve(BATCH_MAX_IOV / 5);
+	own = note;
+	if (own)
+		own->writers.push_back(this);
+}
+
+Reply_Batch::~Reply_Batch()
+{
+	if (ring) {
+		reap();
+		ring->close_ring();
+		delete ring;
+	}
+}
+
+void Reply_Batch::add(const pcap_pkthdr &pph, const iovec *frame, int frame_iovcnt, u_char proto)
+{
+	size_t frame_bytes = 0;
+	for (int i = 0; i < frame_iovcnt; i++)
+		frame_bytes += frame[i].iov_len;
+
+	if (iovcnt + 1 + frame_iovcnt > BATCH_MAX_IOV || bytes + sizeof(pph) + frame_bytes > BATCH_MAX_BYTES)
+		flush(FLUSH_FULL);
+
+	if (replies == 0)
+		first_ns = deadline_ns ? now_ns() : 0;
+
+	if (proto == 1)
+		icmp_replies++;
+	pcap_pkthdr *h = &headers[replies++];
+	*h = pph;
+	iov[iovcnt].iov_base = h;
+	iov[iovcnt].iov_len = sizeof(*h);
+	iovcnt++;
+	for (int i = 0; i < frame_iovcnt; i++)
+		iov[iovcnt++] = frame[i];
+	bytes += sizeof(pph) + frame_bytes;
+
+	if (deadline_ns == 0)
+		flush(FLUSH_DEADLINE); // batching turned off
+}
+
+void Reply_Batch::hold(char *buf)
+{
+	if (buf == NULL || holding(buf))
+		return;
+	held.push_back(buf);
+}
+
+void Reply_Batch::check_deadline()
+{
+	if (replies && now_ns() - first_ns >= deadline_ns)
+		flush(FLUSH_DEADLINE);
+}
+
+// Skip the first n bytes of v
+static void advance(iovec *&v, int &left, size_t n)
+{
+	while (left > 0 && n >= v->iov_len) {
+		n -= v->iov_len;
+		v++;
+		left--;
+	}
+	if (left > 0) {
+		v->iov_base = (char *)v->iov_base + n;
+		v->iov_len -= n;
+	}
+}
+
+// Where the last n bytes written through fd went (see Own_Writes)
+static void note_written(Own_Writes *own, int fd, size_t n)
+{
+	if (own == NULL || n == 0)
+		return;
+	off_t end = lseek(fd, 0, SEEK_CUR);
+	if (end >= (off_t)n)
+		own->add(end - n, end);
+}
+
+static void write_all(int fd, iovec *v, int left, Own_Writes *own)
+{
+	// writev can come up short, so keep going from wherever it stopped
+	while (left > 0) {
+		ssize_t n = writev(fd, v, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writev failed");
+			exit(1);
+		}
+		note_written(own, fd, n);
+		advance(v, left, n);
+	}
+}
+
+void Reply_Batch::begin_write()
+{
+	if (own == NULL)
+		return;
+	struct stat st;
+	uint64_t floor = fstat(fd, &st) == 0 && st.st_size > 0 ? st.st_size : 1;
+	writing_floor.store(floor, std::memory_order_seq_cst);
+}
+
+void Reply_Batch::write_out(iovec *v, int left)
+{
+	begin_write();
+	write_all(fd, v, left, own);
+	writing_floor.store(0, std::memory_order_release);
+}
+
+// n replies (icmp of them ICMP) are in the file now
+void Reply_Batch::written(int n, int icmp)
+{
+	for (int i = 0; i < n; i++)
+		note_reply_sent();
+	Metrics &m = metrics();
+	metric_add(m.icmp_replies, icmp);
+	metric_add(m.udp_replies, n - icmp);
+}
+
+void Reply_Batch::release_all(std::vector<char *> &bufs)
+{
+	for (size_t i = 0; i < bufs.size(); i++) {
+		if (release)
+			release(release_ctx, bufs[i]);
+		else
+			pool->put(bufs[i]);
+	}
+	bufs.clear();
+}
+
+void Reply_Batch::submit()
+{
+	io_uring_sqe *sqe = ring->get_sqe(); // there's room, nothing else is in flight
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1; // O_APPEND puts it at the end anyway
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	begin_write();
+	ring->submit(); // if a signal gets in the way, reap() submits it
+
+	// The kernel has this set now, fill the other one
+	std::swap(iov, sent_iov);
+	std::swap(headers, sent_headers);
+	held.swap(sent_held);
+	sent_iovcnt = iovcnt;
+	sent_bytes = bytes;
+	sent_replies = replies;
+	sent_icmp_replies = icmp_replies;
+}
+
+void Reply_Batch::reap()
+{
+	if (sent_iovcnt == 0)
+		return;
+
+	io_uring_cqe cqe;
+	while (!ring->reap(&cqe, true))
+		; // a signal got in first, the write is still ours to wait for
+	if (cqe.res < 0) {
+		errno = -cqe.res;
+		perror("writev failed");
+		exit(1);
+	}
+	note_written(own, fd, cqe.res); // at the file position (offset -1), so that moved past it too
+	if ((size_t)cqe.res < sent_bytes) {
+		// Came up short, finish it the ordinary way before anything else goes out
+		iovec *v = sent_iov;
+		int left = sent_iovcnt;
+		advance(v, left, cqe.res);
+		write_all(fd, v, left, own);
+	}
+	writing_floor.store(0, std::memory_order_release);
+	// Only now are they in the file, so this is when wakeup->reply stops the clock (like the writev path)
+	written(sent_replies, sent_icmp_replies);
+	sent_iovcnt = 0;
+	sent_bytes = 0;
+	sent_replies = 0;
+	sent_icmp_replies = 0;
+	release_all(sent_held);
+}
+
+void Reply_Batch::flush(Flush_Reason why)
+{
+	uint64_t write_start = lat_now();
+	if (ring)
+		reap(); // the last one has to be out of the way (and its buffers back) before this one goes
+	if (replies == 0)
+		return;
+
+	if (ring)
+		submit();
+	else
+		write_out(iov, iovcnt);
+
+	lat_record(LAT_WRITE, lat_now() - write_start);
+
+	stats.flushes[why]++;
+	stats.batched_replies += replies;
+	if ((uint64_t)replies > stats.batch_max)
+		stats.batch_max = replies;
+
+	if (ring) {
+		// Caught up or done: the -m mapping may move and the buffers may go, so don't leave it in flight
+		if (why == FLUSH_IDLE || why == FLUSH_EXIT)
+			reap();
+	} else {
+		written(replies, icmp_replies);
+		release_all(held);
+	}
+
+	iovcnt = 0;
+	replies = 0;
+	icmp_replies = 0;
+	bytes = 0;
+	first_ns = 0;
+}
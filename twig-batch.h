@@ -0,0 +1,134 @@
+#ifndef TWIG_BATCH_H
+#define TWIG_BATCH_H
+
+#include <sys/uio.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include "twig-utils.h"
+#include "twig-pool.h"
+#include "twig-stats.h"
+#include "twig-uring.h"
+
+/*
+ * Group commit for replies.
+ *
+ * Instead of one writev() per reply, replies are queued as iovecs and the whole
+ * batch goes out in a single writev() when
+ *   - the iovec or byte limit is reached (full),
+ *   - the oldest queued reply has waited longer than the deadline (deadline),
+ *   - the reader caught up with the file and is about to sleep (idle),
+ *   - we're shutting down (exit).
+ *
+ * The iovecs point into packet buffers (in-place replies), so the batch holds on
+ * to those buffers and hands them back to the pool after the flush. With -m they
+ * can also point into the capture mapping, so flush before remapping it.
+ *
+ * When another thread owns the pool (-p), set_release() hands the buffers to
+ * a callback instead so they can be sent back to it.
+ *
+ * With -u a full or deadline flush doesn't wait for the write: it submits the
+ * writev to io_uring and swaps in the other set of iovecs, and the next batch
+ * fills that while the kernel writes this one. It's reaped at the start of
+ * the next flush, so only one is ever in flight and replies still land in
+ * order; that's when its buffers are released and its replies count as sent
+ * (wakeup->reply, twig_replies_total), same as after a writev(). Idle and
+ * exit flushes wait for it, since that's when the -m mapping can move or the
+ * buffers go away.
+ */
+
+#define BATCH_MAX_IOV 1020           // stay under IOV_MAX (1024), 5 iovecs per reply
+#define BATCH_MAX_BYTES (1 << 20)
+#define BATCH_DEFAULT_DEADLINE_US 1000
+
+typedef void (*release_fn)(void *ctx, char *buf);
+
+struct Reply_Batch;
+
+/*
+ * The replies go on the end of the very file we're tailing, so the reader
+ * comes across them too, and answering them would never stop (a UDP echo
+ * from port 7 to port 7 answers itself forever). Every write notes the
+ * [start,end) it landed on: an O_APPEND write leaves its fd's offset at its
+ * own end, so every batch writing the file needs its own open() of it for
+ * that to be exact. The reader skips records that fall in one.
+ *
+ * The bytes of a write can be read before its range is noted, so while a
+ * write is going its batch also shows a floor, the file size when it began.
+ * A record that ends past some batch's floor might be that write's, and the
+ * reader waits for it to finish before deciding.
+ */
+enum Own_Record { OWN_NOT, OWN_YES, OWN_WRITING };
+
+struct Own_Range {
+    uint64_t start, end;
+};
+
+struct Own_Writes {
+    std::mutex lock;
+    std::vector<Own_Range> added;   // noted by the writers, not picked up by the reader yet
+    std::atomic<uint64_t> version;  // bumped with every range added
+    std::vector<Reply_Batch *> writers; // every batch writing the file, set up before any thread starts
+    std::deque<Own_Range> ahead;    // reader: ranges it hasn't passed yet, in file order
+    uint64_t seen_version;
+
+    Own_Writes() : version(0), seen_version(0) {}
+    void add(uint64_t start, uint64_t end);            // a writer, after each write
+    Own_Record classify(uint64_t start, uint64_t end); // the reader, for each record
+};
+
+struct Reply_Batch {
+    int fd;
+    Buffer_Pool *pool;
+    uint64_t deadline_ns;  // 0 = write every reply right away
+
+    iovec iov_space[2][BATCH_MAX_IOV]; // the second one is only for -u
+    pcap_pkthdr header_space[2][BATCH_MAX_IOV / 5]; // the pcap record headers need somewhere to live too
+    iovec *iov;            // the batch being filled
+    pcap_pkthdr *headers;
+    int iovcnt;
+    int replies;
+    int icmp_replies;      // how many of them are ICMP (the rest are UDP), for twig_replies_total
+    size_t bytes;
+    uint64_t first_ns;     // when the oldest queued reply was added
+    std::vector<char *> held;
+    release_fn release;    // NULL = put held buffers straight back in the pool
+    void *release_ctx;
+
+    Uring *ring;           // -u: writes go through this, NULL = writev()
+    iovec *sent_iov;       // -u: the batch the kernel is writing
+    pcap_pkthdr *sent_headers;
+    int sent_iovcnt;       // 0 = nothing in flight
+    size_t sent_bytes;
+    int sent_replies;      // timed (note_reply_sent) and counted once the write completes
+    int sent_icmp_replies;
+    std::vector<char *> sent_held;
+    Own_Writes *own;       // where the writes get noted, NULL when nobody reads this file back (-r, stdin)
+    std::atomic<uint64_t> writing_floor; // file size when the write in progress began, 0 = none
+
+    Reply_Batch() : fd(-1), pool(NULL), deadline_ns(0), iov(iov_space[0]), headers(header_space[0]), iovcnt(0),
+        replies(0), icmp_replies(0), bytes(0), first_ns(0), release(NULL), release_ctx(NULL), ring(NULL), sent_iov(iov_space[1]),
+        sent_headers(header_space[1]), sent_iovcnt(0), sent_bytes(0), sent_replies(0), sent_icmp_replies(0), own(NULL), writing_floor(0) {}
+    Reply_Batch(const Reply_Batch &) = delete; // iov points into it
+    ~Reply_Batch();
+
+    void init(int out_fd, Buffer_Pool *buffers, uint64_t deadline_us, bool want_uring = false, Own_Writes *note = NULL);
+    void set_release(release_fn fn, void *ctx) { release = fn; release_ctx = ctx; }
+    void add(const pcap_pkthdr &pph, const iovec *frame, int frame_iovcnt, u_char proto);
+    void hold(char *buf);             // buf is in use by a queued iovec until the next flush
+    bool holding(const char *buf) const { return !held.empty() && held.back() == buf; }
+    void flush(Flush_Reason why);
+    void check_deadline();
+
+private:
+    void submit();
+    void reap();
+    void written(int n, int icmp);
+    void begin_write();
+    void write_out(iovec *v, int left);
+    void release_all(std::vector<char *> &bufs);
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <string>
+#include "twig-checkpoint.h"
+#include "twig-stats.h"
+#include "twig-log.h"
+
+struct Sidecar {
+    Interface *ifc;
+    std::string path;
+    std::string tmp;
+    struct stat st;  // the capture it's for
+    uint64_t saved;  // offset last written, so an idle file isn't rewritten every second
+};
+
+static std::vector<Sidecar> sidecars;
+static uint64_t next_save_ns;
+
+// Offset just past the last complete record from start on (a partial one is still being written).
+// pcap has no index, so this walks every record header to the end: one pass over the whole file
+// through the mapping before the first packet is answered. Only -t without a usable sidecar pays it.
+static uint64_t find_tail(Interface *ifc, uint64_t start)
+{
+	Pcap_Map walk;
+	if (!walk.init(ifc->fd, start, ifc->byteswap))
+		return start;
+	pcap_pkthdr pph;
+	while (walk.next(&pph))
+		;
+	uint64_t end = walk.offset;
+	walk.close_map();
+	return end;
+}
+
+// The saved offset for this capture, or 0 if there isn't one that fits it
+static uint64_t load(const Sidecar &s, const struct stat &st)
+{
+	FILE *in = fopen(s.path.c_str(), "r");
+	if (in == NULL)
+		return 0; // first run
+	unsigned long dev, ino;
+	uint64_t offset;
+	int got = fscanf(in, "%lu %lu %" SCNu64, &dev, &ino, &offset);
+	fclose(in);
+
+	if (got != 3) {
+		fprintf(stderr, "%s: not a checkpoint, ignoring it\n", s.path.c_str());
+		return 0;
+	}
+	if (dev != (unsigned long)st.st_dev || ino != (unsigned long)st.st_ino) {
+		fprintf(stderr, "%s: checkpoint is for another file, ignoring it\n", s.path.c_str());
+		return 0;
+	}
+	if (offset < sizeof(pcap_file_header) || offset > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: checkpoint is past the end of the file, ignoring it\n", s.path.c_str());
+		return 0;
+	}
+	return offset;
+}
+
+static void save(Sidecar &s)
+{
+	uint64_t offset = s.ifc->done_offset();
+	if (offset == s.saved)
+		return;
+
+	bool written = replace_file(s.path.c_str(), s.tmp.c_str(), [&s, offset](FILE *out) {
+		fprintf(out, "%lu %lu %" PRIu64 "\n", (unsigned long)s.st.st_dev, (unsigned long)s.st.st_ino, offset);
+	});
+	if (written)
+		s.saved = offset;
+}
+
+void checkpoint_resume(Interface *ifc, bool at_tail, bool use_sidecar)
+{
+	if (!at_tail && !use_sidecar)
+		return;
+
+	struct stat st;
+	if (fstat(ifc->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: not a regular file, reading it from the start\n", ifc->filename);
+		return;
+	}
+
+	uint64_t offset = 0;
+	if (use_sidecar) {
+		Sidecar s;
+		s.ifc = ifc;
+		s.path = std::string(ifc->filename) + CHECKPOINT_SUFFIX;
+		s.tmp = s.path + ".tmp";
+		s.st = st;
+		s.saved = 0;
+		offset = load(s, st);
+		ifc->track_done = true;
+		sidecars.push_back(s);
+		next_save_ns = now_ns() + CHECKPOINT_INTERVAL_MS * 1000000ull;
+	}
+	if (offset == 0 && at_tail)
+		offset = find_tail(ifc, sizeof(pcap_file_header));
+	if (offset == 0)
+		return; // from the start, where open_capture() left it
+
+	if (lseek(ifc->fd, offset, SEEK_SET) < 0) {
+		perror(ifc->filename);
+		exit(1);
+	}
+	tlog<LOG_INFO>("%s: starting at offset %" PRIu64 " of %" PRIu64 "\n", ifc->filename, offset, (uint64_t)st.st_size);
+}
+
+void checkpoint_tick()
+{
+	if (sidecars.empty())
+		return;
+	uint64_t now = now_ns();
+	if (now < next_save_ns)
+		return;
+	next_save_ns = now + CHECKPOINT_INTERVAL_MS * 1000000ull;
+	checkpoint_save();
+}
+
+void checkpoint_save()
+{
+	for (size_t i = 0; i < sidecars.size(); i++)
+		save(sidecars[i]);
+}
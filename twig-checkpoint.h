@@ -0,0 +1,42 @@
+#ifndef TWIG_CHECKPOINT_H
+#define TWIG_CHECKPOINT_H
+
+#include <stdint.h>
+#include "twig-iface.h"
+
+/*
+ * Where to pick a capture file back up (-t and -c).
+ *
+ * Without them twig reads every file from its first record, answering
+ * every request it ever held (and appending a second reply to each). On a
+ * long-lived capture that takes minutes and doubles the file.
+ *
+ * -t starts at the last complete record instead: only what arrives after
+ * startup is answered. Finding it means walking every record header in the
+ * file (pcap has no index), so on a multi-GB capture that's one full pass
+ * before the first reply. -c keeps a sidecar, filename.offset, with how far
+ * twig has answered; it's rewritten every CHECKPOINT_INTERVAL_MS while
+ * records are coming in and at exit, and a restart carries on from there
+ * without any scan. With both, the scan only happens when there's no
+ * sidecar to use. The sidecar remembers which file it was for (device and
+ * inode), so a capture that's been replaced or cut short isn't resumed in
+ * the middle of nowhere.
+ *
+ * The saved offset is Interface::done_offset(), not where the reader is:
+ * single-threaded it flushes the queued replies first, and with -p/-w, where
+ * the reader runs ahead, it's the start of the oldest record another thread
+ * still has (its buffer hasn't come back). So a restart never skips a
+ * request that was read but not answered. After a crash it can answer up to
+ * the last interval's requests again; a clean exit saves exactly where it
+ * stopped.
+ */
+
+#define CHECKPOINT_INTERVAL_MS 1000
+#define CHECKPOINT_SUFFIX ".offset"
+
+// Move ifc's read position past the header to where it should start. Before Interface::start().
+void checkpoint_resume(Interface *ifc, bool at_tail, bool use_sidecar);
+void checkpoint_tick(); // save every -c file's offset if the interval is up
+void checkpoint_save(); // save them now
+
+#endif
@@ -0,0 +1,198 @@
+#include <string.h>
+#include "twig-checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TWIG_X86 1
+#endif
+
+uint64_t csum_partial_scalar16(const void *buf, size_t len, uint64_t sum)
+{
+	const u_char *p = (const u_char *)buf;
+
+	// Sum up 16-bit words
+	while (len > 1) {
+		u_short word;
+		memcpy(&word, p, sizeof(word));
+		sum += word;
+		p += 2;
+		len -= 2;
+	}
+
+	// Add any remaining byte (zero padded, so it's the first byte of the word in memory)
+	if (len == 1) {
+		u_short word = 0;
+		memcpy(&word, p, 1);
+		sum += word;
+	}
+	// Same 32-bit result as the real kernels (2^32 == 1 as well)
+	while (sum >> 32)
+		sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	return sum;
+}
+
+/*
+ * Portable kernel: add 8 bytes at a time into a 64-bit accumulator and count the
+ * carries out of it. Since 2^16 == 1 in ones-complement arithmetic, summing wider
+ * words gives the same folded result as summing 16-bit ones, and each carry out
+ * of bit 63 is worth exactly 1.
+ */
+static uint64_t csum_partial_64(const void *buf, size_t len, uint64_t sum)
+{
+	const u_char *p = (const u_char *)buf;
+	uint64_t acc = sum;
+	uint64_t carries = 0;
+
+	while (len >= 32) {
+		uint64_t w[4];
+		memcpy(w, p, sizeof(w));
+		acc += w[0]; carries += acc < w[0];
+		acc += w[1]; carries += acc < w[1];
+		acc += w[2]; carries += acc < w[2];
+		acc += w[3]; carries += acc < w[3];
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		acc += w;
+		carries += acc < w;
+		p += 8;
+		len -= 8;
+	}
+	if (len) {
+		uint64_t w = 0; // zero padded tail, still lined up on a 16-bit word
+		memcpy(&w, p, len);
+		acc += w;
+		carries += acc < w;
+	}
+
+	// Squash back down to 32 bits (2^32 == 1 too), so callers can keep adding to it or store it
+	uint64_t folded = (acc & 0xFFFFFFFF) + (acc >> 32) + carries;
+	folded = (folded & 0xFFFFFFFF) + (folded >> 32);
+	return (folded & 0xFFFFFFFF) + (folded >> 32);
+}
+
+static bool always_supported() { return true; }
+
+#ifdef TWIG_X86
+
+/*
+ * SIMD kernels: widen each 32-bit lane to 64 bits (interleave with zero) and
+ * add those, so nothing can overflow until we've summed gigabytes. The tail
+ * that doesn't fill a vector goes through the portable loop.
+ */
+
+__attribute__((target("sse2")))
+static uint64_t csum_partial_sse2(const void *buf, size_t len, uint64_t sum)
+{
+	const u_char *p = (const u_char *)buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+
+	while (len >= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(c, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(c, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(d, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(d, zero));
+		p += 64;
+		len -= 64;
+	}
+	while (len >= 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		p += 16;
+		len -= 16;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+	sum = csum_partial_64(p, len, sum);
+	return csum_partial_64(lanes, sizeof(lanes), sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_partial_avx2(const void *buf, size_t len, uint64_t sum)
+{
+	// Headers and RFC 1624 patches are a few bytes, where setting up the ymm registers costs
+	// more than the sum (a lot more on some VMs, see checksum.avx2 in make bench)
+	if (len < 64)
+		return csum_partial_64(buf, len, sum);
+	const u_char *p = (const u_char *)buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+
+	while (len >= 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)p);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(p + 96));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(c, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(c, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(d, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(d, zero));
+		p += 128;
+		len -= 128;
+	}
+	while (len >= 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)p);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	sum = csum_partial_64(p, len, sum);
+	return csum_partial_64(lanes, sizeof(lanes), sum);
+}
+
+static bool have_sse2() { __builtin_cpu_init(); return __builtin_cpu_supports("sse2"); }
+static bool have_avx2() { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+
+#endif
+
+const Checksum_Kernel checksum_kernels[] = {
+#ifdef TWIG_X86
+	{ "avx2", csum_partial_avx2, have_avx2 },
+	{ "sse2", csum_partial_sse2, have_sse2 },
+#endif
+	{ "portable64", csum_partial_64, always_supported },
+};
+const int checksum_kernel_count = sizeof(checksum_kernels) / sizeof(checksum_kernels[0]);
+
+static const Checksum_Kernel *picked = NULL;
+
+static csum_partial_fn pick_kernel()
+{
+	for (int i = 0; i < checksum_kernel_count; i++) {
+		if (checksum_kernels[i].supported()) {
+			picked = &checksum_kernels[i];
+			return picked->partial;
+		}
+	}
+	picked = &checksum_kernels[checksum_kernel_count - 1];
+	return picked->partial;
+}
+
+csum_partial_fn csum_partial = pick_kernel();
+
+const char *checksum_kernel_name()
+{
+	return picked->name;
+}
@@ -0,0 +1,66 @@
+#ifndef TWIG_CHECKSUM_H
+#define TWIG_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Internet checksum (RFC 1071), one implementation for IP, ICMP and UDP.
+ *
+ * csum_partial() adds buf into a running ones-complement sum without folding
+ * it, so a checksum can be built up from pieces that aren't next to each other
+ * (header here, payload over there). Every piece but the last has to be an even
+ * number of bytes. csum_fold() turns the running sum into the value that goes
+ * in the header. Every kernel hands back a sum that fits in 32 bits (whatever
+ * sum it was given), so it's safe to keep in a uint32_t, but not yet folded to
+ * 16: the kernels can disagree on the unfolded value, only the folded one is
+ * the same everywhere.
+ *
+ * The kernel behind csum_partial() is picked once at startup with CPUID:
+ * AVX2, then SSE2, then a portable 64-bit accumulator loop.
+ */
+
+typedef uint64_t (*csum_partial_fn)(const void *buf, size_t len, uint64_t sum);
+
+struct Checksum_Kernel {
+    const char *name;
+    csum_partial_fn partial;
+    bool (*supported)();
+};
+
+// Every kernel built into this binary, best first (the bench walks these)
+extern const Checksum_Kernel checksum_kernels[];
+extern const int checksum_kernel_count;
+
+extern csum_partial_fn csum_partial; // the one CPUID picked
+
+const char *checksum_kernel_name();
+
+// One 16-bit word at a time, like the old *_checksum_maker loops. Reference only.
+uint64_t csum_partial_scalar16(const void *buf, size_t len, uint64_t sum);
+
+inline u_short csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+inline u_short inet_checksum(const void *buf, size_t len)
+{
+    return csum_fold(csum_partial(buf, len, 0));
+}
+
+/*
+ * Incremental update (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m')
+ * hc is the checksum already in the header, removed/added are csum_partial()
+ * sums of the bytes before and after they were rewritten. Costs the same no
+ * matter how much data the checksum covers.
+ */
+inline u_short csum_update(u_short hc, uint64_t removed, uint64_t added)
+{
+    return csum_fold((u_short)~hc + (uint64_t)csum_fold(removed) + added);
+}
+
+#endif
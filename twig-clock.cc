@@ -0,0 +1,33 @@
+#include <arpa/inet.h>
+#include "twig-clock.h"
+
+thread_local Loop_Clock loop_clock;
+
+bool precise_timestamps = false;
+
+void Loop_Clock::refresh()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	mono_sec = ts.tv_sec;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (ts.tv_sec != wall_sec)
+		rfc868 = htonl((uint32_t)ts.tv_sec + RFC868_EPOCH_OFFSET); // wraps in 2036, so does RFC 868
+	wall_sec = ts.tv_sec;
+	wall_usec = ts.tv_nsec / 1000;
+}
+
+void Loop_Clock::reply_stamp(uint32_t *secs, uint32_t *usecs) const
+{
+	if (precise_timestamps) {
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		*secs = ts.tv_sec;
+		*usecs = ts.tv_nsec / 1000;
+		return;
+	}
+	*secs = wall_sec;
+	*usecs = wall_usec;
+}
@@ -0,0 +1,38 @@
+#ifndef TWIG_CLOCK_H
+#define TWIG_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The main loop's clock. Read once per wakeup (and every so many records when
+ * we're busy) so the per-packet code can look at the time without a syscall.
+ * Both reads are clock_gettime(), which the vDSO answers from the TSC.
+ *
+ * Reply timestamps and time service replies come from here too. With -P
+ * (precise_timestamps) every reply's pcap timestamp is read fresh instead,
+ * for when the capture is used to measure our latency.
+ */
+
+#define CLOCK_REFRESH_RECORDS 64 // re-read the clock at least this often under load
+#define RFC868_EPOCH_OFFSET 2208988800u // seconds from 1900-01-01 to 1970-01-01
+
+extern bool precise_timestamps;
+
+struct Loop_Clock {
+    uint64_t mono_ns;  // CLOCK_MONOTONIC
+    uint32_t mono_sec;
+    time_t wall_sec;   // CLOCK_REALTIME, for anything a human reads
+    uint32_t wall_usec;
+    uint32_t rfc868;   // wall_sec as RFC 868 time: seconds since 1900, network byte order
+
+    constexpr Loop_Clock() : mono_ns(0), mono_sec(0), wall_sec(0), wall_usec(0), rfc868(0) {}
+    void refresh();
+    void reply_stamp(uint32_t *secs, uint32_t *usecs) const; // wall time for a reply's pcap header
+
+    time_t to_wall(uint32_t mono) const { return wall_sec - (time_t)(mono_sec - mono); }
+};
+
+extern thread_local Loop_Clock loop_clock; // every thread that handles packets keeps its own
+
+#endif
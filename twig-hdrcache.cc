@@ -0,0 +1,71 @@
+#include <string.h>
+#include <inttypes.h>
+#include "twig-hdrcache.h"
+#include "twig-checksum.h"
+#include "twig-arp-shared.h"
+
+Header_Cache::Header_Cache() : hits(0), misses(0), evictions(0)
+{
+	memset(slots, 0, sizeof(slots));
+}
+
+void Header_Cache::turn_around(char *frame, u_short ip_len)
+{
+	eth_hdr *eh = (eth_hdr *)frame;
+	IPv4 *ip = (IPv4 *)(frame + sizeof(eth_hdr));
+
+	u_char key[24];
+	memcpy(key, eh->src, 6);
+	memcpy(key + 6, eh->dest, 6);
+	memcpy(key + 12, ip->src, 4);
+	memcpy(key + 16, ip->dest, 4);
+	key[20] = ip->hlen;
+	key[21] = ip->vers;
+	key[22] = ip->type;
+	key[23] = 1;
+
+	uint32_t peer;
+	memcpy(&peer, ip->src, 4);
+	Reply_Template *set = slots[arp_hash(peer + ip->type) & (HDR_CACHE_SETS - 1)];
+
+	Reply_Template *t;
+	if (memcmp(set[0].key, key, sizeof(key)) == 0) {
+		t = &set[0];
+		hits++;
+	} else if (memcmp(set[1].key, key, sizeof(key)) == 0) {
+		t = &set[1];
+		hits++;
+	} else {
+		misses++;
+		t = set[0].last_used <= set[1].last_used ? &set[0] : &set[1];
+		if (t->key[23]) evictions++;
+
+		eth_hdr *te = (eth_hdr *)t->hdr;
+		IPv4 *tip = (IPv4 *)(t->hdr + sizeof(eth_hdr));
+		memcpy(te->dest, eh->src, 6);
+		memcpy(te->src, eh->dest, 6);
+		te->type = eh->type;
+		memcpy(tip, ip, sizeof(IPv4));
+		memcpy(tip->src, ip->dest, 4);
+		memcpy(tip->dest, ip->src, 4);
+		tip->len = 0;
+		tip->frag_ident = 0;
+		tip->frag_offset = 0;
+		tip->ttl = 64;
+		tip->csum = 0;
+		t->sum = csum_partial(tip, sizeof(IPv4), 0);
+		memcpy(t->key, key, sizeof(key));
+	}
+	t->last_used = hits + misses;
+
+	memcpy(frame, t->hdr, REPLY_HDR_BYTES);
+	ip->len = byteswap16(ip_len);
+	ip->csum = csum_fold(t->sum + ip->len); // the length is the only word the saved sum is missing
+}
+
+void Header_Cache::print_stats(FILE *out) const
+{
+	uint64_t n = hits + misses;
+	fprintf(out, "%-20s %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit), %" PRIu64 " evictions\n", "reply templates",
+		hits, misses, n ? 100.0 * hits / n : 0.0, evictions);
+}
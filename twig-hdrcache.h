@@ -0,0 +1,51 @@
+#ifndef TWIG_HDRCACHE_H
+#define TWIG_HDRCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "twig-utils.h"
+
+/*
+ * Reply header templates, one per peer.
+ *
+ * Every reply's Ethernet and IPv4 headers are the request's turned around:
+ * addresses swapped, ident/fragment zeroed, TTL 64. Only the length differs
+ * from one reply to the next, and most traffic comes from a handful of peers,
+ * so the first reply to a peer builds the 34 header bytes (length 0) and sums
+ * them, and later ones copy the block, drop the length in and fold it into the
+ * saved sum.
+ *
+ * The key is everything a template is built from: both MACs and IPs, the
+ * protocol and the version/TOS bytes. Two-way set associative, a new peer
+ * takes over whichever of the two was used longer ago. Each thread that
+ * builds replies has its own (see Interface::make_shard), so there's no
+ * locking.
+ */
+
+#define HDR_CACHE_SETS 128 // power of two, two templates each
+#define REPLY_HDR_BYTES (sizeof(eth_hdr) + sizeof(IPv4))
+
+struct Reply_Template {
+    u_char key[24];              // last byte is 1, so an empty slot never matches
+    u_char hdr[REPLY_HDR_BYTES]; // what goes on the wire, ip.len and ip.csum zero
+    uint64_t sum;                // csum_partial() of the IP part of hdr (unfolded, so all 64 bits)
+    uint32_t last_used;          // hits + misses when it was last used
+};
+
+struct Header_Cache {
+    Reply_Template slots[HDR_CACHE_SETS][2];
+
+    // stats
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; // a miss that threw out another peer's template
+
+    Header_Cache();
+
+    // frame holds the request's Ethernet and IPv4 headers, overwrite them with the reply's
+    void turn_around(char *frame, u_short ip_len);
+    void print_stats(FILE *out) const;
+};
+
+#endif
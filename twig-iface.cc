@@ -0,0 +1,167 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "twig-iface.h"
+
+Interface::Interface(const std::string &iface_name, const char *file) :
+	name(iface_name), filename(file), fd(-1), out_fd(-1), byteswap(false), use_mmap(false), use_uring(false), open(false),
+	started(false), own(NULL), record_buffer(NULL), arp(NULL), shared_arp(NULL), index(0), owner(NULL), parent(NULL),
+	handing_off(false), track_done(false), handed_first(0), handed_done(0)
+{
+	memset(&pfh, 0, sizeof(pfh));
+}
+
+Interface::~Interface()
+{
+	stop();
+	delete arp;
+	delete shared_arp;
+	if (!parent)
+		delete own;
+}
+
+bool Interface::start(bool want_mmap, bool want_uring, long deadline_us, Timer_Wheel *timers)
+{
+	arp = new ARP_Cache(); // starts small and grows as we learn neighbours
+	arp->set_aging(timers, ARP_TIMEOUT_SEC);
+
+	// Just past the header, unless -t or -c moved us on
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		pos = sizeof(pfh); // a pipe
+	use_mmap = want_mmap && pmap.init(fd, pos, byteswap);
+
+	pool.init(pfh.snaplen);
+	if (!use_mmap)
+		stream.init(fd, pos, pool.snaplen, byteswap, want_uring);
+	record_buffer = pool.get();
+	replies.init(out_fd, &pool, deadline_us, want_uring, own);
+	use_uring = want_uring;
+	open = true;
+	started = true;
+	return use_mmap == want_mmap;
+}
+
+Interface *Interface::make_shard(void *worker, Timer_Wheel *timers, long deadline_us)
+{
+	Interface *shard = new Interface(name, filename);
+	shard->fd = fd;
+	shard->out_fd = out_fd;
+	shard->own = own;
+	if (own) {
+		// Its own open file description, so its offset after a write is where that write went
+		shard->out_fd = ::open(filename, O_WRONLY | O_APPEND);
+		if (shard->out_fd < 0) {
+			perror(filename);
+			exit(1);
+		}
+	}
+	shard->pfh = pfh;
+	shard->byteswap = byteswap;
+	shard->use_uring = use_uring;
+	shard->index = index;
+	shard->owner = worker;
+	shard->parent = this;
+
+	shard->arp = new ARP_Cache();
+	shard->arp->set_aging(timers, ARP_TIMEOUT_SEC);
+	if (shared_arp)
+		shard->arp->set_shared(shared_arp);
+	shard->replies.init(shard->out_fd, &pool, deadline_us, use_uring, own); // the buffers are the parent's (see Reply_Batch::set_release)
+	shard->open = true;
+	shard->started = true;
+	return shard;
+}
+
+void Interface::stop()
+{
+	if (!started)
+		return;
+	started = false;
+	open = false;
+
+	replies.flush(FLUSH_EXIT);
+	if (parent) {
+		if (out_fd != parent->out_fd)
+			close(out_fd);
+		out_fd = -1;
+		return; // the files and the pool are the parent's
+	}
+
+	if (record_buffer)
+		pool.put(record_buffer);
+	record_buffer = NULL;
+	pool.destroy();
+	pmap.close_map();
+	stream.close_stream();
+	if (fd > 0) close(fd); // 0 is stdin, leave it alone
+	if (out_fd > 0) close(out_fd);
+	fd = out_fd = -1;
+}
+
+void Interface::hand_off(char *record, const pcap_pkthdr &pph)
+{
+	if (!track_done)
+		return;
+	uint64_t end = read_offset();
+	if (handed.empty())
+		handed_done = end - sizeof(pcap_pkthdr) - pph.caplen;
+	pool.tag(record) = handed_first + handed.size();
+	Handed_Record h;
+	h.end = end;
+	h.back = false;
+	handed.push_back(h);
+}
+
+void Interface::take_back(char *buf)
+{
+	if (track_done) {
+		// Buffers come back out of order (a reply waits for its batch, a drop doesn't), so only
+		// move past the ones at the front that are all back
+		handed[pool.tag(buf) - handed_first].back = true;
+		while (!handed.empty() && handed.front().back) {
+			handed_done = handed.front().end;
+			handed.pop_front();
+			handed_first++;
+		}
+	}
+	pool.put(buf);
+}
+
+uint64_t Interface::done_offset()
+{
+	if (handing_off)
+		return handed.empty() ? read_offset() : handed_done;
+
+	// Everything read has been handled here, only its replies can still be queued
+	if (started)
+		replies.flush(FLUSH_IDLE);
+	return read_offset();
+}
+
+void Interface::print_stats(FILE *out) const
+{
+	fprintf(out, "### %s (%s) ###\n", name.c_str(), filename);
+	fprintf(out, "%-20s %" PRIu64 "\n", "records", counters.records);
+	fprintf(out, "%-20s %" PRIu64 "\n", "icmp replies", counters.icmp_replies);
+	fprintf(out, "%-20s %" PRIu64 "\n", "udp replies", counters.udp_replies);
+	fprintf(out, "%-20s %" PRIu64 "\n", "udp unknown port", counters.udp_unknown);
+	fprintf(out, "%-20s %" PRIu64 "\n", "arp packets", counters.arp_packets);
+	fprintf(out, "%-20s %" PRIu64 "\n", "oversize drops", counters.oversize_drops);
+	if (own)
+		fprintf(out, "%-20s %" PRIu64 "\n", "own replies skipped", counters.own_replies);
+	if (!parent && !use_mmap)
+		fprintf(out, "%-20s %" PRIu64 "\n", "read calls", stream.reads);
+	if (stream.ring)
+		fprintf(out, "%-20s %" PRIu64 " enters, %" PRIu64 " waited for\n", "uring reads", stream.ring->submits, stream.ring->waits);
+	if (replies.ring && replies.ring->submits)
+		fprintf(out, "%-20s %" PRIu64 " enters, %" PRIu64 " waited for\n", "uring writes", replies.ring->submits, replies.ring->waits);
+	if (arp)
+		arp->print_stats(out);
+	else if (shared_arp)
+		shared_arp->print_stats(out);
+	headers.print_stats(out);
+	fflush(out);
+}
@@ -0,0 +1,97 @@
+#ifndef TWIG_IFACE_H
+#define TWIG_IFACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include "twig-utils.h"
+#include "twig-mmap.h"
+#include "twig-stream.h"
+#include "twig-pool.h"
+#include "twig-batch.h"
+#include "twig-arp.h"
+#include "twig-hdrcache.h"
+#include "twig-timer.h"
+
+/*
+ * One network segment twig answers on.
+ *
+ * Every -i (or the plain filename) gets one of these: its own capture file,
+ * reader, buffer pool, reply batch, ARP cache and counters. They all share
+ * one main loop, one inotify/epoll waiter and one timer wheel, so a single
+ * process can serve every segment on a router.
+ */
+
+#define IFACE_BURST 64 // records to take from one file before looking at the next
+
+struct Iface_Counters {
+    uint64_t records;        // pcap records read
+    uint64_t bytes;          // their captured bytes
+    uint64_t icmp_packets;
+    uint64_t udp_packets;
+    uint64_t icmp_replies;
+    uint64_t udp_replies;
+    uint64_t udp_unknown;    // requests for ports no service is registered on, dropped
+    uint64_t arp_packets;
+    uint64_t oversize_drops; // records bigger than snaplen, skipped
+    uint64_t own_replies;    // records we wrote ourselves, skipped
+
+    Iface_Counters() : records(0), bytes(0), icmp_packets(0), udp_packets(0), icmp_replies(0), udp_replies(0), udp_unknown(0), arp_packets(0), oversize_drops(0), own_replies(0) {}
+};
+
+// -c with -p/-w: a record the reader has passed to another thread
+struct Handed_Record {
+    uint64_t end;   // file offset just past it
+    bool back;      // its buffer came back: no reply, or the reply has been written
+};
+
+struct Interface {
+    std::string name;     // network/mask for -i, otherwise the filename
+    const char *filename;
+    int fd;               // reading
+    int out_fd;           // replies get appended here; separate from fd so O_APPEND doesn't move our read position
+    pcap_file_header pfh; // host byte order
+    bool byteswap;        // the file is in the other byte order
+    bool use_mmap;        // -m asked for and the file could be mapped
+    bool use_uring;       // -u: reads and reply writes go through io_uring
+    bool open;            // still being read
+    bool started;         // set up by start() and not torn down yet
+
+    Pcap_Map pmap;
+    Pcap_Stream stream;   // the reader when it isn't mapped
+    Buffer_Pool pool;     // request and reply buffers, sized from this file's snaplen
+    Reply_Batch replies;  // replies waiting to be appended to this file
+    Own_Writes *own;      // where our replies landed in the file, so the reader skips them (NULL for -r and stdin)
+    char *record_buffer;  // read() mode reuses this one until a queued reply needs it
+    ARP_Cache *arp;
+    Shared_ARP *shared_arp; // -w: the table all the shards of this interface learn into
+    Header_Cache headers; // reply Ethernet/IP headers by peer
+    Iface_Counters counters;
+    int index;            // position on the command line
+    void *owner;          // the Pipeline (-p) or Worker (-w) running it, NULL otherwise
+    Interface *parent;    // -w: this is one worker's shard of parent (shares its files and buffers)
+    bool handing_off;     // -p/-w: the reader passes every record on to another thread
+    bool track_done;      // -c: keep handed up to date so done_offset() can look past the reader
+    std::deque<Handed_Record> handed; // records out with another thread, oldest first
+    uint64_t handed_first; // pool tag (sequence number) of handed.front()
+    uint64_t handed_done;  // just past the last record before handed.front()
+
+    Interface(const std::string &iface_name, const char *file);
+    ~Interface();
+
+    // The file is open and its header checked; set up everything else. False if -m had to fall back to read().
+    bool start(bool want_mmap, bool want_uring, long deadline_us, Timer_Wheel *timers);
+    // -w: a copy for one worker with its own ARP front end, reply batch, header templates and counters, on the same files
+    Interface *make_shard(void *worker, Timer_Wheel *timers, long deadline_us);
+    void stop(); // flush what's queued and let go of the file (only once every thread is done with it)
+    uint64_t read_offset() const { return use_mmap ? pmap.offset : stream.offset; } // where the next record starts
+    // Reader: record (pph is host order) is going to another thread, and a buffer it gave out is back
+    void hand_off(char *record, const pcap_pkthdr &pph);
+    void take_back(char *buf);
+    // Everything before here has been answered and the replies written, so it's where a restart picks up
+    uint64_t done_offset();
+    void print_stats(FILE *out) const;
+};
+
+#endif
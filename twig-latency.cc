@@ -0,0 +1,104 @@
+#include <inttypes.h>
+#include <unistd.h>
+#include "twig-latency.h"
+#include "twig-utils.h"
+#include "twig-stats.h"
+
+#if TWIG_LATENCY
+
+static const char *stage_names[LAT_STAGES] = {
+	"read", "handle icmp", "handle udp", "handle arp", "handle other",
+	"arp learn", "checksum", "writev",
+};
+
+thread_local Lat_Set *lat_mine;
+
+static Thread_Blocks<Lat_Set, LAT_MAX_THREADS> sets;
+
+// Where the ticks started, to work out how long one is when we print
+static const uint64_t base_ticks = lat_now();
+static const uint64_t base_ns = now_ns();
+
+Lat_Set *lat_claim()
+{
+	lat_mine = sets.claim();
+	return lat_mine;
+}
+
+static uint64_t bucket_value(int b)
+{
+	// Middle of the bucket
+	if (b < 16)
+		return b;
+	int e = (b - 16) / 4 + 4;
+	uint64_t width = 1ull << (e - 2);
+	return (uint64_t)(4 + (b - 16) % 4) * width + width / 2;
+}
+
+static uint64_t percentile(const Lat_Hist &h, uint64_t count, double p)
+{
+	uint64_t want = (uint64_t)(count * p);
+	if (want >= count)
+		want = count - 1;
+	uint64_t seen = 0;
+	for (int b = 0; b < LAT_BUCKETS; b++) {
+		seen += h.buckets[b];
+		if (seen > want)
+			return bucket_value(b) < h.max ? bucket_value(b) : h.max;
+	}
+	return h.max;
+}
+
+void print_histograms(FILE *out)
+{
+#ifdef LAT_TSC
+	uint64_t ticks = lat_now() - base_ticks;
+	uint64_t ns = now_ns() - base_ns;
+	if (ns < 1000000) {
+		// Too soon after startup to tell the TSC rate, give it a couple of ms
+		usleep(2000);
+		ticks = lat_now() - base_ticks;
+		ns = now_ns() - base_ns;
+	}
+	double ns_per_tick = ticks ? (double)ns / ticks : 1.0;
+#else
+	double ns_per_tick = 1.0;
+#endif
+
+	Lat_Set total = Lat_Set();
+	sets.for_each([&total](const Lat_Set &set) {
+		for (int s = 0; s < LAT_STAGES; s++) {
+			for (int b = 0; b < LAT_BUCKETS; b++)
+				total.stage[s].buckets[b] += __atomic_load_n(&set.stage[s].buckets[b], __ATOMIC_RELAXED);
+			uint64_t max = __atomic_load_n(&set.stage[s].max, __ATOMIC_RELAXED);
+			if (max > total.stage[s].max)
+				total.stage[s].max = max;
+		}
+	});
+
+	fprintf(out, "### latency ###\n");
+	for (int s = 0; s < LAT_STAGES; s++) {
+		const Lat_Hist &h = total.stage[s];
+		uint64_t count = 0;
+		for (int b = 0; b < LAT_BUCKETS; b++)
+			count += h.buckets[b];
+		if (count == 0) {
+			fprintf(out, "%-20s n=0\n", stage_names[s]);
+			continue;
+		}
+		fprintf(out, "%-20s n=%" PRIu64 " p50=%.2fus p99=%.2fus p99.9=%.2fus max=%.2fus\n", stage_names[s], count,
+			percentile(h, count, 0.50) * ns_per_tick / 1000, percentile(h, count, 0.99) * ns_per_tick / 1000,
+			percentile(h, count, 0.999) * ns_per_tick / 1000, h.max * ns_per_tick / 1000);
+	}
+	fflush(out);
+}
+
+#else
+
+void print_histograms(FILE *out)
+{
+	fprintf(out, "### latency ###\ncompiled out (build with LATENCY=1)\n");
+	fflush(out);
+}
+
+#endif
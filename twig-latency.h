@@ -0,0 +1,118 @@
+#ifndef TWIG_LATENCY_H
+#define TWIG_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-stage latency histograms, for finding out where a slow twig spends its
+ * time: getting a record, handling it (by protocol), ARP learning, rewriting
+ * the headers and checksums, and the writev() of a reply batch.
+ *
+ * Stages are timed in TSC cycles (CLOCK_MONOTONIC off x86) and counted into
+ * log-bucketed histograms, 4 buckets per power of two, so percentiles come out
+ * within about 12%. Every thread counts into its own set and never locks; the
+ * dump reads all of them while they're being written, which is fine for
+ * counters that only go up. They're printed at exit and on SIGUSR1.
+ *
+ * It's off unless built with make LATENCY=1. Timing every stage takes six TSC
+ * reads per packet, which is about as long as answering the packet, so a normal
+ * build compiles it out: lat_now() is a constant, lat_record() and Lat_Scope are
+ * empty and nothing is left in the packet path. (Run make clean when switching,
+ * the objects don't know the flag changed.)
+ */
+
+#ifndef TWIG_LATENCY
+#define TWIG_LATENCY 0
+#endif
+
+#if TWIG_LATENCY && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define LAT_TSC 1
+#endif
+
+enum Lat_Stage {
+    LAT_READ,         // next_record(), only counted when it found one
+    LAT_HANDLE_ICMP,  // handle_record() from the top, by what the packet was
+    LAT_HANDLE_UDP,
+    LAT_HANDLE_ARP,
+    LAT_HANDLE_OTHER,
+    LAT_ARP_LEARN,    // ARP_Cache::add_entry() on every IPv4 packet
+    LAT_CHECKSUM,     // reply header template and checksum fixups
+    LAT_WRITE,        // one reply batch writev() (with its short write retries)
+    LAT_STAGES
+};
+
+#define LAT_BUCKETS 256   // 16 exact ones for tiny values, then 4 per power of two up to 2^64
+#define LAT_MAX_THREADS 80 // reader + pipeline threads or SHARD_MAX_WORKERS workers, with room to spare
+
+#if TWIG_LATENCY
+
+struct Lat_Hist {
+    uint64_t buckets[LAT_BUCKETS];
+    uint64_t max;
+};
+
+struct Lat_Set {
+    Lat_Hist stage[LAT_STAGES];
+};
+
+extern thread_local Lat_Set *lat_mine;
+
+Lat_Set *lat_claim(); // this thread's set, made on its first record
+
+inline uint64_t lat_now()
+{
+#ifdef LAT_TSC
+	return __rdtsc();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+inline int lat_bucket(uint64_t v)
+{
+	if (v < 16)
+		return (int)v;
+	int e = 63 - __builtin_clzll(v); // 4 and up
+	return 16 + (e - 4) * 4 + (int)((v >> (e - 2)) & 3);
+}
+
+inline void lat_record(Lat_Stage s, uint64_t ticks)
+{
+	Lat_Set *set = lat_mine ? lat_mine : lat_claim();
+	Lat_Hist &h = set->stage[s];
+	// Only this thread writes its set, so a plain add is enough; the atomics just
+	// keep the dump from reading torn values
+	uint64_t *b = &h.buckets[lat_bucket(ticks)];
+	__atomic_store_n(b, __atomic_load_n(b, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	if (ticks > __atomic_load_n(&h.max, __ATOMIC_RELAXED))
+		__atomic_store_n(&h.max, ticks, __ATOMIC_RELAXED);
+}
+
+// Times the rest of the enclosing block
+struct Lat_Scope {
+    Lat_Stage stage;
+    uint64_t start;
+
+    explicit Lat_Scope(Lat_Stage s) : stage(s), start(lat_now()) {}
+    ~Lat_Scope() { lat_record(stage, lat_now() - start); }
+};
+
+#else
+
+inline uint64_t lat_now() { return 0; }
+inline void lat_record(Lat_Stage, uint64_t) {}
+
+struct Lat_Scope {
+    explicit Lat_Scope(Lat_Stage) {}
+};
+
+#endif
+
+void print_histograms(FILE *out); // every thread's sets added up, p50/p99/p99.9/max per stage
+
+#endif
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include "twig-log.h"
+
+int log_level = LOG_OFF;
+int log_every = 1;
+
+thread_local bool log_sampled = true;
+thread_local uint32_t log_packets;
+
+/*
+ * The ring is the bounded MPMC queue where every entry carries the position
+ * it's ready for: seq == pos means free for the producer that claims pos (by
+ * moving head on with a CAS), seq == pos + 1 means filled in and ready for
+ * the consumer, who hands it back with seq = pos + LOG_RING_SIZE. Only the
+ * formatting thread consumes, so tail is plain.
+ */
+static Log_Entry *ring;
+static std::atomic<size_t> head;
+static size_t tail;
+static std::atomic<uint64_t> dropped;
+static uint64_t written;
+
+static std::thread formatter;
+static std::atomic<bool> stopping;
+
+static Log_Entry *claim()
+{
+	if (ring == NULL)
+		return NULL; // logging was never started
+	size_t pos = head.load(std::memory_order_relaxed);
+	while (true) {
+		Log_Entry *e = &ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = e->seq.load(std::memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return e;
+		} else if (dif < 0) {
+			// Full, the formatter is behind. Without -L every line was asked for, so wait
+			// for it like printf() would have; with -L keeping the timing matters more.
+			if (log_every == 1) {
+				sched_yield();
+				pos = head.load(std::memory_order_relaxed);
+				continue;
+			}
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		} else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+static void publish(Log_Entry *e)
+{
+	// claim() only hands out e when seq was its position, so this is position + 1
+	e->seq.store(e->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void log_push(const char *fmt, int nargs, const Log_Arg *args)
+{
+	Log_Entry *e = claim();
+	if (e == NULL)
+		return;
+	e->fmt = fmt;
+	e->nargs = nargs;
+	memcpy(e->args, args, nargs * sizeof(Log_Arg));
+	publish(e);
+}
+
+void log_push_hex(const char *prefix, const void *data, size_t len)
+{
+	Log_Entry *e = claim();
+	if (e == NULL)
+		return;
+	e->fmt = NULL;
+	e->args[0].u = (uint64_t)(uintptr_t)prefix;
+	e->hex_total = len;
+	e->hex_len = len < LOG_HEX_MAX ? len : LOG_HEX_MAX;
+	memcpy(&e->args[1], data, e->hex_len);
+	publish(e);
+}
+
+// printf() one conversion (spec is "%...c") with the argument cast back to what it says
+static void format_one(FILE *out, const char *spec, size_t spec_len, Log_Arg arg)
+{
+	char s[32];
+	if (spec_len >= sizeof(s)) {
+		fwrite(spec, 1, spec_len, out);
+		return;
+	}
+	memcpy(s, spec, spec_len);
+	s[spec_len] = '\0';
+
+	char conv = s[spec_len - 1];
+	const char *len = s + 1;
+	while (strchr("-+ #0123456789.", *len))
+		len++;
+	bool hh = len[0] == 'h' && len[1] == 'h', h = !hh && len[0] == 'h';
+	bool ll = len[0] == 'l' && len[1] == 'l', l = !ll && (len[0] == 'l' || len[0] == 'j' || len[0] == 't');
+	bool z = len[0] == 'z';
+
+	switch (conv) {
+	case 'd': case 'i':
+		if (hh) fprintf(out, s, (signed char)arg.u);
+		else if (h) fprintf(out, s, (short)arg.u);
+		else if (ll) fprintf(out, s, (long long)arg.u);
+		else if (l) fprintf(out, s, (long)arg.u);
+		else if (z) fprintf(out, s, (ssize_t)arg.u);
+		else fprintf(out, s, (int)arg.u);
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		if (hh) fprintf(out, s, (unsigned char)arg.u);
+		else if (h) fprintf(out, s, (unsigned short)arg.u);
+		else if (ll) fprintf(out, s, (unsigned long long)arg.u);
+		else if (l) fprintf(out, s, (unsigned long)arg.u);
+		else if (z) fprintf(out, s, (size_t)arg.u);
+		else fprintf(out, s, (unsigned)arg.u);
+		break;
+	case 'c':
+		fprintf(out, s, (int)arg.u);
+		break;
+	case 's': {
+		const char *str = (const char *)(uintptr_t)arg.u;
+		fprintf(out, s, str ? str : "(null)");
+		break;
+	}
+	case 'p':
+		fprintf(out, s, (void *)(uintptr_t)arg.u);
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		fprintf(out, s, arg.d);
+		break;
+	default:
+		fwrite(spec, 1, spec_len, out); // not something tlog() takes
+	}
+}
+
+static void format_entry(FILE *out, const Log_Entry *e)
+{
+	if (e->fmt == NULL) {
+		fprintf(out, "%s:", (const char *)(uintptr_t)e->args[0].u);
+		const u_char *b = (const u_char *)&e->args[1];
+		for (int i = 0; i < e->hex_len; i++)
+			fprintf(out, " %02x", b[i]);
+		if (e->hex_total > e->hex_len)
+			fprintf(out, " ... (%u bytes)", e->hex_total);
+		fputc('\n', out);
+		return;
+	}
+
+	const char *p = e->fmt;
+	int arg = 0;
+	while (*p) {
+		const char *pct = strchr(p, '%');
+		if (pct == NULL) {
+			fputs(p, out);
+			break;
+		}
+		fwrite(p, 1, pct - p, out);
+		if (pct[1] == '%') {
+			fputc('%', out);
+			p = pct + 2;
+			continue;
+		}
+		const char *end = pct + 1;
+		while (*end && !strchr("diouxXcspfFeEgGaA", *end))
+			end++;
+		if (*end == '\0') {
+			fputs(pct, out);
+			break;
+		}
+		if (arg < e->nargs)
+			format_one(out, pct, end + 1 - pct, e->args[arg++]);
+		p = end + 1;
+	}
+}
+
+static void formatter_loop()
+{
+	while (true) {
+		Log_Entry *e = &ring[tail & (LOG_RING_SIZE - 1)];
+		if (e->seq.load(std::memory_order_acquire) != tail + 1) {
+			// Nothing ready. Only leave once we're told to and there's nothing left.
+			fflush(stdout);
+			if (stopping.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == tail)
+				break;
+			usleep(1000);
+			continue;
+		}
+		format_entry(stdout, e);
+		written++;
+		e->seq.store(tail + LOG_RING_SIZE, std::memory_order_release);
+		tail++;
+	}
+	fflush(stdout);
+}
+
+void log_start(bool wanted)
+{
+	if (!wanted || TWIG_LOG_LEVEL == LOG_OFF)
+		return;
+	ring = new Log_Entry[LOG_RING_SIZE];
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq.store(i, std::memory_order_relaxed);
+
+	// Signals are for the main loop
+	sigset_t block, old;
+	sigfillset(&block);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	formatter = std::thread(formatter_loop);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void log_stop()
+{
+	if (ring == NULL)
+		return;
+	stopping.store(true, std::memory_order_release);
+	formatter.join();
+}
+
+void log_print_stats(FILE *out)
+{
+	if (ring == NULL)
+		return;
+	fprintf(out, "%-20s %" PRIu64 " (%" PRIu64 " dropped with the ring full)\n", "log lines", written,
+		dropped.load(std::memory_order_relaxed));
+}
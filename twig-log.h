@@ -0,0 +1,136 @@
+#ifndef TWIG_LOG_H
+#define TWIG_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+#include <atomic>
+
+/*
+ * Debug logging that doesn't change the timing it's trying to show.
+ *
+ * tlog<LOG_DEBUG>("fmt", args...) doesn't format anything: it copies the
+ * format pointer and the raw arguments into a bounded lock-free ring (any
+ * thread can log) and a background thread does the printf()s to stdout.
+ *
+ * Levels are checked twice. At compile time, anything above TWIG_LOG_LEVEL
+ * (make LOG_LEVEL=n) is an empty function and its arguments are never even
+ * looked at, so make LOG_LEVEL=0 takes every debug line out of the packet
+ * path. At run time, -td turns on LOG_DEBUG and -d LOG_TRACE.
+ *
+ * -L n samples: each packet-handling thread logs one packet in n
+ * (handle_record() calls log_next_packet()), so -d can stay on under load.
+ * With -L a full ring drops the message (and counts it) rather than make the
+ * packet wait; without it every line was asked for, so the packet waits.
+ *
+ * Arguments are stored as 64-bit words and cast back by the conversion in
+ * the format, so use the right length modifiers (%zu for size_t and so on).
+ * A %s argument is formatted later, so it has to stay put until then: string
+ * literals and names that live as long as twig. Use tlog_hex() for bytes.
+ */
+
+enum Log_Level { LOG_OFF, LOG_ERROR, LOG_INFO, LOG_DEBUG, LOG_TRACE };
+
+#ifndef TWIG_LOG_LEVEL
+#define TWIG_LOG_LEVEL LOG_TRACE
+#endif
+
+#define LOG_RING_SIZE 4096 // entries, a power of two
+#define LOG_MAX_ARGS 13    // what fits a 128-byte entry
+#define LOG_HEX_MAX ((LOG_MAX_ARGS - 1) * 8) // bytes tlog_hex() keeps (args[0] is its prefix), the rest are just counted
+
+extern int log_level; // highest level that gets logged, LOG_OFF until -td/-d
+extern int log_every; // -L: log one packet in this many
+
+extern thread_local bool log_sampled; // this packet is one of the sampled ones
+extern thread_local uint32_t log_packets;
+
+union Log_Arg {
+    uint64_t u;
+    double d;
+};
+
+struct alignas(64) Log_Entry {
+    std::atomic<size_t> seq; // ring position it's ready for (see twig-log.cc)
+    const char *fmt;         // NULL for a hex dump, with the prefix in args[0]
+    uint16_t nargs;
+    uint16_t hex_len;        // bytes in hex
+    uint32_t hex_total;      // bytes there were
+    Log_Arg args[LOG_MAX_ARGS];
+};
+static_assert(sizeof(Log_Entry) == 128, "log entries should be two cache lines");
+
+template <typename T>
+inline Log_Arg log_arg(T v)
+{
+	Log_Arg a;
+	if constexpr (std::is_floating_point<T>::value)
+		a.d = v;
+	else if constexpr (std::is_pointer<T>::value)
+		a.u = (uint64_t)(uintptr_t)v;
+	else
+		a.u = (uint64_t)(int64_t)v; // sign extended, the conversion takes back what it needs
+	return a;
+}
+
+void log_push(const char *fmt, int nargs, const Log_Arg *args);
+void log_push_hex(const char *prefix, const void *data, size_t len);
+
+template <int L>
+inline bool log_on()
+{
+	if constexpr (L > TWIG_LOG_LEVEL)
+		return false;
+	else
+		return L <= log_level && (L < LOG_DEBUG || log_sampled);
+}
+
+template <int L, typename... Args>
+inline void tlog(const char *fmt, Args... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many arguments for one log entry");
+	if constexpr (L <= TWIG_LOG_LEVEL) {
+		if (log_on<L>()) {
+			Log_Arg a[sizeof...(Args) + 1] = { log_arg(args)... };
+			log_push(fmt, sizeof...(Args), a);
+		}
+	}
+}
+
+// Same, but on says whether it's wanted instead of log_level (for -a)
+template <int L, typename... Args>
+inline void tlog_if(bool on, const char *fmt, Args... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many arguments for one log entry");
+	if constexpr (L <= TWIG_LOG_LEVEL) {
+		if (on && (L < LOG_DEBUG || log_sampled)) {
+			Log_Arg a[sizeof...(Args) + 1] = { log_arg(args)... };
+			log_push(fmt, sizeof...(Args), a);
+		}
+	}
+}
+
+// "prefix: 01 02 03 ...", the bytes are copied now
+template <int L>
+inline void tlog_hex(const char *prefix, const void *data, size_t len)
+{
+	if constexpr (L <= TWIG_LOG_LEVEL) {
+		if (log_on<L>())
+			log_push_hex(prefix, data, len);
+	}
+}
+
+inline void log_next_packet()
+{
+	if constexpr (TWIG_LOG_LEVEL >= LOG_DEBUG) {
+		if (log_every > 1 && log_level >= LOG_DEBUG)
+			log_sampled = log_packets++ % log_every == 0;
+	}
+}
+
+void log_start(bool wanted); // starts the formatting thread if anything is going to be logged
+void log_stop();  // prints whatever is left and stops it
+void log_print_stats(FILE *out);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <string>
+#include "twig-metrics.h"
+#include "twig-utils.h"
+#include "twig-stats.h"
+
+thread_local Metrics *metrics_mine;
+uint8_t udp_port_slot[65536];
+
+static Thread_Blocks<Metrics, METRICS_MAX_THREADS> blocks;
+
+static u_short slot_ports[METRICS_UDP_SLOTS];
+static int slots_used = 1;
+
+static const char *metrics_path;
+static std::string metrics_tmp;
+static uint64_t next_write_ns;
+
+Metrics *metrics_claim()
+{
+	metrics_mine = blocks.claim();
+	return metrics_mine;
+}
+
+void metrics_watch_udp_port(u_short port)
+{
+	if (udp_port_slot[port])
+		return;
+	if (slots_used == METRICS_UDP_SLOTS)
+		return; // out of series, this one gets lumped in with the rest
+	slot_ports[slots_used] = port;
+	udp_port_slot[port] = slots_used++;
+}
+
+void metrics_start(const char *path)
+{
+	metrics_path = path;
+	if (path == NULL)
+		return;
+	metrics_tmp = std::string(path) + ".tmp";
+	next_write_ns = now_ns();
+}
+
+void metrics_tick()
+{
+	if (metrics_path == NULL)
+		return;
+	uint64_t now = now_ns();
+	if (now < next_write_ns)
+		return;
+	next_write_ns = now + METRICS_INTERVAL_MS * 1000000ull;
+	metrics_write();
+}
+
+static void add_up(Metrics *total)
+{
+	uint64_t *to = (uint64_t *)total;
+	const size_t words = sizeof(Metrics) / sizeof(uint64_t); // it's nothing but counters
+
+	blocks.for_each([to, words](const Metrics &m) {
+		const uint64_t *from = (const uint64_t *)&m;
+		for (size_t w = 0; w < words; w++)
+			to[w] += __atomic_load_n(&from[w], __ATOMIC_RELAXED);
+	});
+}
+
+static const char *proto_name(int proto, char *buf, size_t len)
+{
+	switch (proto) {
+	case 1: return "icmp";
+	case 6: return "tcp";
+	case 17: return "udp";
+	case 58: return "icmpv6";
+	}
+	snprintf(buf, len, "%d", proto);
+	return buf;
+}
+
+static void header(FILE *out, const char *name, const char *help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+}
+
+static void print_metrics(FILE *out, const Metrics &total)
+{
+	static const char *eth_names[MET_ETHERTYPES] = { "ipv4", "arp", "ipv6", "other" };
+	header(out, "twig_packets_total", "Packets read, by ethertype.");
+	for (int i = 0; i < MET_ETHERTYPES; i++)
+		fprintf(out, "twig_packets_total{ethertype=\"%s\"} %" PRIu64 "\n", eth_names[i], total.eth_packets[i]);
+	header(out, "twig_bytes_total", "Captured bytes read, by ethertype.");
+	for (int i = 0; i < MET_ETHERTYPES; i++)
+		fprintf(out, "twig_bytes_total{ethertype=\"%s\"} %" PRIu64 "\n", eth_names[i], total.eth_bytes[i]);
+
+	char num[8];
+	header(out, "twig_ip_packets_total", "IPv4 packets read, by protocol.");
+	for (int p = 0; p < 256; p++)
+		if (total.ip_packets[p])
+			fprintf(out, "twig_ip_packets_total{proto=\"%s\"} %" PRIu64 "\n", proto_name(p, num, sizeof(num)), total.ip_packets[p]);
+	header(out, "twig_ip_bytes_total", "Captured bytes of IPv4 packets read, by protocol.");
+	for (int p = 0; p < 256; p++)
+		if (total.ip_packets[p])
+			fprintf(out, "twig_ip_bytes_total{proto=\"%s\"} %" PRIu64 "\n", proto_name(p, num, sizeof(num)), total.ip_bytes[p]);
+
+	header(out, "twig_udp_packets_total", "UDP packets read, by destination port (\"other\" is every port without a service).");
+	for (int s = 0; s < slots_used; s++) {
+		if (s) snprintf(num, sizeof(num), "%u", slot_ports[s]);
+		fprintf(out, "twig_udp_packets_total{port=\"%s\"} %" PRIu64 "\n", s ? num : "other", total.udp_packets[s]);
+	}
+	header(out, "twig_udp_bytes_total", "Captured bytes of UDP packets read, by destination port.");
+	for (int s = 0; s < slots_used; s++) {
+		if (s) snprintf(num, sizeof(num), "%u", slot_ports[s]);
+		fprintf(out, "twig_udp_bytes_total{port=\"%s\"} %" PRIu64 "\n", s ? num : "other", total.udp_bytes[s]);
+	}
+
+	header(out, "twig_replies_total", "Replies written to the capture file, by protocol.");
+	fprintf(out, "twig_replies_total{proto=\"icmp\"} %" PRIu64 "\n", total.icmp_replies);
+	fprintf(out, "twig_replies_total{proto=\"udp\"} %" PRIu64 "\n", total.udp_replies);
+
+	static const char *drop_names[DROP_REASONS] = { "oversize", "not_echo", "no_service", "service", "unhandled" };
+	header(out, "twig_drops_total", "Packets read but not answered, by reason.");
+	for (int i = 0; i < DROP_REASONS; i++)
+		fprintf(out, "twig_drops_total{reason=\"%s\"} %" PRIu64 "\n", drop_names[i], total.drops[i]);
+
+	header(out, "twig_arp_learns_total", "Hosts added to an ARP cache.");
+	fprintf(out, "twig_arp_learns_total %" PRIu64 "\n", total.arp_learns);
+	header(out, "twig_arp_evictions_total", "Hosts aged out of an ARP cache.");
+	fprintf(out, "twig_arp_evictions_total %" PRIu64 "\n", total.arp_evictions);
+}
+
+void metrics_write()
+{
+	if (metrics_path == NULL)
+		return;
+
+	Metrics total = Metrics();
+	add_up(&total);
+	replace_file(metrics_path, metrics_tmp.c_str(), [&total](FILE *out) { print_metrics(out, total); });
+}
@@ -0,0 +1,80 @@
+#ifndef TWIG_METRICS_H
+#define TWIG_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Live counters for scraping (-S statsfile).
+ *
+ * Unlike Twig_Stats and the interface counters, which are folded together
+ * once the threads are done, these can be read while twig runs: every thread
+ * that touches packets counts into its own block (aligned to its own cache
+ * lines, so the -w workers never share one), and the main loop adds them all
+ * up every METRICS_INTERVAL_MS and writes them out in Prometheus text format.
+ * The file is written next to the real one and renamed over it, so a scraper
+ * (node_exporter's textfile collector, or a plain cat) never sees half of it.
+ *
+ * Counting is a load and a store to this thread's block, no locked
+ * instructions; the atomics only keep the reader from seeing torn values.
+ */
+
+#define METRICS_INTERVAL_MS 1000
+#define METRICS_UDP_SLOTS 16    // slot 0 is every UDP port without a service
+#define METRICS_MAX_THREADS 80  // same bound as the latency sets
+
+enum Metric_Ethertype { MET_ETH_IPV4, MET_ETH_ARP, MET_ETH_IPV6, MET_ETH_OTHER, MET_ETHERTYPES };
+
+enum Drop_Reason {
+    DROP_OVERSIZE,    // bigger than snaplen, skipped unread
+    DROP_NOT_ECHO,    // ICMP that isn't an echo request (echo replies from other hosts, mostly)
+    DROP_NO_SERVICE,  // UDP to a port nobody registered
+    DROP_SERVICE,     // a UDP service chose not to answer
+    DROP_UNHANDLED,   // other ethertypes and IP protocols, or too short for their headers
+    DROP_REASONS
+};
+
+struct alignas(64) Metrics {
+    uint64_t eth_packets[MET_ETHERTYPES];
+    uint64_t eth_bytes[MET_ETHERTYPES];
+    uint64_t ip_packets[256];   // by IP protocol number
+    uint64_t ip_bytes[256];
+    uint64_t udp_packets[METRICS_UDP_SLOTS]; // by destination port, see metrics_watch_udp_port()
+    uint64_t udp_bytes[METRICS_UDP_SLOTS];
+    uint64_t icmp_replies;
+    uint64_t udp_replies;
+    uint64_t drops[DROP_REASONS];
+    uint64_t arp_learns;        // hosts added to an ARP cache
+    uint64_t arp_evictions;     // hosts aged out of one
+};
+
+extern thread_local Metrics *metrics_mine;
+extern uint8_t udp_port_slot[65536]; // set up before any packets, read-only after
+
+Metrics *metrics_claim(); // this thread's block, made the first time it counts
+
+inline Metrics &metrics()
+{
+	return *(metrics_mine ? metrics_mine : metrics_claim());
+}
+
+inline void metric_add(uint64_t &counter, uint64_t n = 1)
+{
+	// Only the owning thread writes a block
+	__atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+inline void count_udp_port(u_short port, uint64_t bytes)
+{
+	Metrics &m = metrics();
+	metric_add(m.udp_packets[udp_port_slot[port]]);
+	metric_add(m.udp_bytes[udp_port_slot[port]], bytes);
+}
+
+void metrics_watch_udp_port(u_short port); // give a service port its own series
+void metrics_start(const char *path);      // -S: where to write them (NULL = don't)
+void metrics_tick();                       // write them out if the interval is up
+void metrics_write();                      // write them out now
+
+#endif
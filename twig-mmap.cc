@@ -0,0 +1,72 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include "twig-mmap.h"
+
+bool Pcap_Map::init(int file_fd, size_t start, bool swapped)
+{
+	fd = file_fd;
+	offset = start;
+	byteswap = swapped;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return false; // can't map a pipe
+	refresh();
+	return true;
+}
+
+bool Pcap_Map::refresh()
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return false;
+
+	size_t size = st.st_size;
+	if (size <= mapped)
+		return false;
+
+	void *p;
+	if (base == NULL)
+		p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	else
+		p = mremap(base, mapped, size, MREMAP_MAYMOVE); // usually grows in place, no copying either way
+
+	if (p == MAP_FAILED) {
+		perror("mmap failed for capture file");
+		return false;
+	}
+	base = (char *)p;
+	mapped = size;
+	return true;
+}
+
+char *Pcap_Map::next(pcap_pkthdr *pph)
+{
+	if (offset + sizeof(pcap_pkthdr) > mapped)
+		return NULL;
+
+	char *record = base + offset;
+	*pph = *(pcap_pkthdr *)record;
+	if (byteswap) {
+		pph->ts_secs = byteswap32(pph->ts_secs);
+		pph->ts_usecs = byteswap32(pph->ts_usecs);
+		pph->caplen = byteswap32(pph->caplen);
+		pph->len = byteswap32(pph->len);
+	}
+
+	// The shim may still be in the middle of writing this one, leave it for later
+	if (offset + sizeof(pcap_pkthdr) + pph->caplen > mapped)
+		return NULL;
+
+	offset += sizeof(pcap_pkthdr) + pph->caplen;
+	return record;
+}
+
+void Pcap_Map::close_map()
+{
+	if (base)
+		munmap(base, mapped);
+	base = NULL;
+	mapped = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef TWIG_MMAP_H
+#define TWIG_MMAP_H
+
+#include <sys/types.h>
+#include "twig-utils.h"
+
+/*
+ * Zero-copy pcap reader (-m).
+ *
+ * Maps the whole capture file read-only and walks the records in place, so a
+ * packet costs no syscalls and no copies. Records are handed out as pointers
+ * into the mapping; since ICMP_packet/UDP_packet are packed pcap header + frame
+ * layouts, a record pointer can be used directly as a header view.
+ *
+ * The file keeps growing while we tail it, so refresh() remaps it. Anything
+ * handed out by next() is only valid until the next refresh().
+ */
+struct Pcap_Map {
+    int fd;
+    char *base;     // start of the mapping (NULL until the file has data past the header)
+    size_t mapped;  // bytes of the file currently mapped
+    size_t offset;  // file offset of the next record
+    bool byteswap;  // record headers are in the other byte order
+
+    Pcap_Map() : fd(-1), base(NULL), mapped(0), offset(0), byteswap(false) {}
+
+    bool init(int file_fd, size_t start, bool swapped);
+    bool refresh(); // remap if the file grew, true if there's new data to look at
+    char *next(pcap_pkthdr *pph); // next complete record (pph in host order) or NULL
+    void close_map();
+};
+
+#endif
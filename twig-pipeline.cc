@@ -0,0 +1,243 @@
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "twig-pipeline.h"
+#include "twig-wait.h"
+#include "twig-clock.h"
+
+void Stage_Waker::init()
+{
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		perror("eventfd failed");
+		exit(1);
+	}
+}
+
+void Stage_Waker::poke()
+{
+	// Pairs with the fence in wait(): either the sleeper sees the new item or we see it asleep
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) {
+		uint64_t one = 1;
+		if (write(efd, &one, sizeof(one)) < 0) {
+			// already has a wakeup pending, that's all we wanted
+		}
+	}
+}
+
+void start_stage_threads(const std::function<void()> &start)
+{
+	// Signals should land on the reader (it's the one sleeping in epoll_wait), and new threads inherit the mask
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	start();
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void release_to_reader(void *ctx, char *buf)
+{
+	Interface *ifc = (Interface *)ctx;
+	((Pipeline *)ifc->owner)->give_back(ifc, buf);
+}
+
+void Pipeline::start(std::vector<Interface *> *ifaces, record_fn handle_record, tick_fn tick_clock)
+{
+	interfaces = ifaces;
+	handle = handle_record;
+	tick = tick_clock;
+	dispatch_waker.init();
+	writer_waker.init();
+
+	for (size_t n = 0; n < interfaces->size(); n++) {
+		Interface *ifc = (*interfaces)[n];
+		ifc->owner = this;
+		ifc->handing_off = true;
+		ifc->replies.set_release(release_to_reader, ifc);
+		// Every record gets its own buffer now, the reader hands out a fresh one each time
+		if (ifc->record_buffer) {
+			ifc->pool.put(ifc->record_buffer);
+			ifc->record_buffer = NULL;
+		}
+	}
+
+	start_stage_threads([this]() {
+		dispatch_thread = std::thread(&Pipeline::dispatch_loop, this);
+		writer_thread = std::thread(&Pipeline::writer_loop, this);
+	});
+}
+
+void Pipeline::push_frame(Interface *ifc, char *record, const pcap_pkthdr &pph)
+{
+	Pipe_Frame f;
+	f.ifc = ifc;
+	f.record = record;
+	f.pph = pph;
+	if (!frames.push(f)) {
+		frames.full_stalls++;
+		// Keep the spares moving while we wait, the stages downstream may be waiting on us for those
+		do {
+			recycle();
+			sched_yield();
+		} while (!frames.push(f));
+	}
+	dispatch_waker.poke();
+}
+
+void Pipeline::recycle()
+{
+	Pipe_Buffer b;
+	while (dispatch_spares.pop(b))
+		b.ifc->take_back(b.buf);
+	while (writer_spares.pop(b))
+		b.ifc->take_back(b.buf);
+}
+
+void Pipeline::finish()
+{
+	reader_done.store(true, std::memory_order_release);
+	dispatch_waker.poke();
+
+	// The writer's last flushes hand back every buffer it held, so keep taking them
+	while (!writer_done.load(std::memory_order_acquire)) {
+		recycle();
+		usleep(100);
+	}
+	dispatch_thread.join();
+	writer_thread.join();
+	recycle();
+}
+
+void Pipeline::queue_reply(Interface *ifc, const pcap_pkthdr &pph, const iovec *frame, int iovcnt, char *buf, u_char proto)
+{
+	Pipe_Reply r;
+	r.ifc = ifc;
+	r.buf = buf;
+	r.pph = pph;
+	r.iovcnt = iovcnt;
+	r.proto = proto;
+	for (int i = 0; i < iovcnt && i < PIPE_REPLY_IOV; i++)
+		r.frame[i] = frame[i];
+	while (!replies.push(r)) {
+		replies.full_stalls++;
+		writer_waker.poke();
+		sched_yield();
+	}
+	writer_waker.poke();
+	taken = true;
+}
+
+void Pipeline::give_back(Interface *ifc, char *buf)
+{
+	Pipe_Buffer b;
+	b.ifc = ifc;
+	b.buf = buf;
+	while (!writer_spares.push(b)) {
+		writer_spares.full_stalls++;
+		sched_yield();
+	}
+}
+
+void Pipeline::dispatch_loop()
+{
+	tick(); // this thread's loop clock starts out at zero
+	int since_tick = 0;
+	while (true) {
+		Pipe_Frame f;
+		if (frames.pop(f)) {
+			taken = false;
+			handle(f.ifc, f.record, f.pph);
+			if (!taken) {
+				Pipe_Buffer b;
+				b.ifc = f.ifc;
+				b.buf = f.record;
+				while (!dispatch_spares.push(b)) {
+					dispatch_spares.full_stalls++;
+					sched_yield();
+				}
+			}
+			if (++since_tick >= CLOCK_REFRESH_RECORDS) {
+				since_tick = 0;
+				tick();
+			}
+			continue;
+		}
+
+		if (reader_done.load(std::memory_order_acquire) && frames.empty())
+			break;
+		frames.empty_waits++;
+		auto ready = [this] { return !frames.empty() || reader_done.load(std::memory_order_acquire); };
+		if (dispatch_waker.spin(ready))
+			continue;
+		dispatch_waker.wait(ready, WAIT_TIMEOUT_MS);
+		tick(); // the ARP timers still have to run when nothing's arriving
+		since_tick = 0;
+	}
+
+	fold_stats();
+	dispatch_done.store(true, std::memory_order_release);
+	writer_waker.poke();
+}
+
+void Pipeline::writer_loop()
+{
+	std::vector<Interface *> &ifaces = *interfaces;
+	while (true) {
+		Pipe_Reply r;
+		if (replies.pop(r)) {
+			r.ifc->replies.add(r.pph, r.frame, r.iovcnt, r.proto);
+			r.ifc->replies.hold(r.buf);
+			if (r.ifc->replies.replies)
+				r.ifc->replies.check_deadline();
+			continue;
+		}
+
+		for (size_t n = 0; n < ifaces.size(); n++)
+			if (ifaces[n]->replies.replies)
+				ifaces[n]->replies.check_deadline();
+
+		if (dispatch_done.load(std::memory_order_acquire) && replies.empty())
+			break;
+
+		// Caught up: same as the single-threaded loop, get everything out before sleeping
+		replies.empty_waits++;
+		auto ready = [this] { return !replies.empty() || dispatch_done.load(std::memory_order_acquire); };
+		if (writer_waker.spin(ready))
+			continue;
+		for (size_t n = 0; n < ifaces.size(); n++)
+			ifaces[n]->replies.flush(FLUSH_IDLE);
+		writer_waker.wait(ready, WAIT_TIMEOUT_MS);
+	}
+
+	for (size_t n = 0; n < ifaces.size(); n++)
+		ifaces[n]->replies.flush(FLUSH_EXIT);
+	fold_stats();
+	writer_done.store(true, std::memory_order_release);
+}
+
+template <typename Ring>
+static void print_ring(FILE *out, const char *name, const Ring &r)
+{
+	fprintf(out, "%-20s %" PRIu64 " pushed, depth avg=%.1f max=%" PRIu64 ", %" PRIu64 " full stalls, %" PRIu64 " empty waits\n",
+		name, r.pushes, r.depth_samples ? (double)r.depth_total / r.depth_samples : 0.0, r.max_depth,
+		r.full_stalls, r.empty_waits);
+}
+
+void Pipeline::print_stats(FILE *out) const
+{
+	fprintf(out, "### pipeline ###\n");
+	print_ring(out, "reader->dispatch", frames);
+	print_ring(out, "dispatch->writer", replies);
+	print_ring(out, "spares from dispatch", dispatch_spares);
+	print_ring(out, "spares from writer", writer_spares);
+	fprintf(out, "%-20s dispatch %" PRIu64 ", writer %" PRIu64 "\n", "stage sleeps",
+		dispatch_waker.sleeps, writer_waker.sleeps);
+	fflush(out);
+}
@@ -0,0 +1,155 @@
+#ifndef TWIG_PIPELINE_H
+#define TWIG_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "twig-utils.h"
+#include "twig-ring.h"
+#include "twig-iface.h"
+
+/*
+ * Pipelined mode (-p).
+ *
+ *   reader (main thread) --frames--> dispatch --replies--> writer
+ *         ^                            |                     |
+ *         +-------- spare buffers -----+---------------------+
+ *
+ * The reader reads records into pool buffers and passes them on, the dispatch
+ * thread runs do_ICMP/do_UDP (and owns the ARP caches, the loop clock and the
+ * timer wheel), and the writer owns the reply batches and does the writev()s.
+ * So a slow write no longer holds up parsing the next packet.
+ *
+ * Every link is an Spsc_Ring. The pools stay single-threaded: buffers the
+ * dispatch thread didn't reply with, and buffers the writer is done with, go
+ * back to the reader on their own rings and it puts them back in the pools.
+ *
+ * A stage with nothing to do spins for a bit and then sleeps on an eventfd the
+ * stage feeding it pokes.
+ */
+
+#define PIPE_RING_SIZE 256      // frames/replies in flight between two stages
+#define PIPE_RETURN_SIZE 4096   // spare buffers on their way back (room for every batch's held buffers)
+#define PIPE_SPIN 64            // empty looks before a stage goes to sleep
+#define PIPE_REPLY_IOV 4        // eth, ip, l4, payload
+
+struct Pipe_Frame {
+    Interface *ifc;
+    char *record;
+    pcap_pkthdr pph; // host order
+};
+
+struct Pipe_Reply {
+    Interface *ifc;
+    char *buf;       // goes back to the reader after the batch is written
+    pcap_pkthdr pph; // file order, ready to write
+    iovec frame[PIPE_REPLY_IOV];
+    int iovcnt;
+    u_char proto;    // IP protocol, for the reply counters
+};
+
+struct Pipe_Buffer {
+    Interface *ifc;
+    char *buf;
+};
+
+// Lets a stage sleep until the stage before it has something for it
+struct Stage_Waker {
+    int efd;
+    std::atomic<bool> sleeping;
+    uint64_t sleeps;
+
+    Stage_Waker() : efd(-1), sleeping(false), sleeps(0) {}
+    void init();
+    void poke();                                   // producer, after a push
+    template <typename Ready> bool spin(Ready ready); // consumer: true if ready() came true without sleeping
+    template <typename Ready> void wait(Ready ready, int timeout_ms); // consumer: sleep unless ready()
+};
+
+template <typename Ready>
+inline bool Stage_Waker::spin(Ready ready)
+{
+    for (int i = 0; i < PIPE_SPIN; i++) {
+        if (ready())
+            return true;
+        sched_yield();
+    }
+    return false;
+}
+
+template <typename Ready>
+inline void Stage_Waker::wait(Ready ready, int timeout_ms)
+{
+    sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ready()) {
+        sleeps++;
+        pollfd p;
+        p.fd = efd;
+        p.events = POLLIN;
+        poll(&p, 1, timeout_ms);
+        uint64_t n;
+        if (read(efd, &n, sizeof(n)) < 0) {
+            // timed out (or a spurious wakeup), nothing to clear
+        }
+    }
+    sleeping.store(false, std::memory_order_relaxed);
+}
+
+// Runs start() with SIGINT/SIGTERM/SIGUSR1 blocked, so the threads it starts leave them to the reader (-p, -w)
+void start_stage_threads(const std::function<void()> &start);
+
+typedef void (*record_fn)(Interface *ifc, char *record, struct pcap_pkthdr &pph);
+typedef void (*tick_fn)();
+
+struct Pipeline {
+    Spsc_Ring<Pipe_Frame, PIPE_RING_SIZE> frames;            // reader -> dispatch
+    Spsc_Ring<Pipe_Reply, PIPE_RING_SIZE> replies;           // dispatch -> writer
+    Spsc_Ring<Pipe_Buffer, PIPE_RETURN_SIZE> dispatch_spares; // dispatch -> reader
+    Spsc_Ring<Pipe_Buffer, PIPE_RETURN_SIZE> writer_spares;   // writer -> reader
+
+    Stage_Waker dispatch_waker;
+    Stage_Waker writer_waker;
+    std::atomic<bool> reader_done;
+    std::atomic<bool> dispatch_done;
+    std::atomic<bool> writer_done;
+
+    std::vector<Interface *> *interfaces;
+    record_fn handle;
+    tick_fn tick;
+    bool taken;      // dispatch thread: the frame it's on turned into a reply
+
+    std::thread dispatch_thread;
+    std::thread writer_thread;
+
+    Pipeline() : reader_done(false), dispatch_done(false), writer_done(false),
+        interfaces(NULL), handle(NULL), tick(NULL), taken(false) {}
+
+    void start(std::vector<Interface *> *ifaces, record_fn handle_record, tick_fn tick_clock);
+
+    // reader
+    void push_frame(Interface *ifc, char *record, const pcap_pkthdr &pph);
+    void recycle();  // spare buffers back into their pools
+    void finish();   // no more frames; wait for the other stages to drain
+
+    // dispatch
+    void queue_reply(Interface *ifc, const pcap_pkthdr &pph, const iovec *frame, int iovcnt, char *buf, u_char proto);
+
+    // writer
+    void give_back(Interface *ifc, char *buf);
+
+    void print_stats(FILE *out) const;
+
+private:
+    void dispatch_loop();
+    void writer_loop();
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "twig-pool.h"
+#include "twig-utils.h"
+#include "twig-stats.h"
+
+void Buffer_Pool::init(size_t file_snaplen)
+{
+	snaplen = file_snaplen;
+	if (snaplen == 0 || snaplen > POOL_MAX_SNAPLEN)
+		snaplen = POOL_MAX_SNAPLEN; // 0 (or garbage) means "no limit"
+	if (snaplen < POOL_MIN_SNAPLEN)
+		snaplen = POOL_MIN_SNAPLEN;
+
+	buf_size = (sizeof(pcap_pkthdr) + snaplen + sizeof(uint64_t) + 63) & ~(size_t)63;
+	grow();
+}
+
+void Buffer_Pool::grow()
+{
+	char *chunk = (char *)aligned_alloc(64, buf_size * POOL_CHUNK);
+	if (chunk == NULL) {
+		perror("malloc failed for packet buffer pool");
+		exit(1);
+	}
+	stats.pool_mallocs++;
+	stats.pool_bytes += buf_size * POOL_CHUNK;
+
+	chunks.push_back(chunk);
+	free_list.reserve(chunks.size() * POOL_CHUNK); // so put() never has to allocate
+	for (int i = POOL_CHUNK - 1; i >= 0; i--)
+		free_list.push_back(chunk + i * buf_size);
+}
+
+char *Buffer_Pool::get()
+{
+	if (free_list.empty())
+		grow();
+
+	char *buf = free_list.back();
+	free_list.pop_back();
+
+	in_use++;
+	stats.pool_gets++;
+	if (in_use > stats.pool_peak)
+		stats.pool_peak = in_use;
+	return buf;
+}
+
+void Buffer_Pool::put(char *buf)
+{
+	if (buf == NULL)
+		return;
+	free_list.push_back(buf);
+	in_use--;
+}
+
+void Buffer_Pool::destroy()
+{
+	for (size_t i = 0; i < chunks.size(); i++)
+		free(chunks[i]);
+	chunks.clear();
+	free_list.clear();
+	in_use = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef TWIG_POOL_H
+#define TWIG_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Fixed-size packet buffer pool.
+ *
+ * Every buffer is big enough for a pcap record header plus snaplen bytes of
+ * packet, which is the most any record in the file can hold (and so the most
+ * any reply we build can need). Buffers are carved out of malloc'd chunks and
+ * handed back with put() once a reply has been written, so after warm-up the
+ * hot path never touches the allocator and memory stays flat.
+ */
+
+#define POOL_CHUNK 16        // buffers per malloc'd chunk
+#define POOL_MIN_SNAPLEN 256  // room for the headers even on tiny snaplens
+#define POOL_MAX_SNAPLEN 262144 // what libpcap caps snaplen at
+
+struct Buffer_Pool {
+    size_t buf_size;   // bytes per buffer (pcap_pkthdr + snaplen + a tag, cache line rounded)
+    size_t snaplen;    // biggest packet a buffer can hold
+    size_t in_use;
+    std::vector<char *> free_list;
+    std::vector<char *> chunks;
+
+    Buffer_Pool() : buf_size(0), snaplen(0), in_use(0) {}
+
+    void init(size_t file_snaplen);
+    char *get();
+    void put(char *buf);
+    // A word past the packet space that no reply touches, for the reader to stamp a buffer with
+    uint64_t &tag(char *buf) const { return *(uint64_t *)(buf + buf_size - sizeof(uint64_t)); }
+    void destroy();
+
+private:
+    void grow();
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef TWIG_RING_H
+#define TWIG_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring.
+ *
+ * One thread pushes, one thread pops, nothing else touches it. Each side owns
+ * its index on its own cache line and keeps a cached copy of the other side's
+ * index, so it only reads the shared one when the ring looks full (producer)
+ * or empty (consumer). The counters also belong to one side each, so they're
+ * plain integers.
+ */
+
+#define RING_CACHE_LINE 64
+#define RING_DEPTH_SAMPLE 16 // look at the real depth every this many pushes (it costs a shared read)
+
+template <typename T, size_t N>
+struct Spsc_Ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    // producer side
+    alignas(RING_CACHE_LINE) std::atomic<size_t> head; // next slot to fill
+    size_t tail_seen;
+    uint64_t pushes;
+    uint64_t full_stalls;  // pushes that found the ring full
+    uint64_t depth_samples;
+    uint64_t depth_total;  // sampled depths, for the average
+    uint64_t max_depth;
+
+    // consumer side
+    alignas(RING_CACHE_LINE) std::atomic<size_t> tail; // next slot to empty
+    size_t head_seen;
+    uint64_t empty_waits;  // times the consumer ran dry and had to wait
+
+    alignas(RING_CACHE_LINE) T items[N];
+
+    Spsc_Ring() : head(0), tail_seen(0), pushes(0), full_stalls(0), depth_samples(0), depth_total(0), max_depth(0),
+        tail(0), head_seen(0), empty_waits(0) {}
+
+    bool push(const T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail_seen == N) {
+            tail_seen = tail.load(std::memory_order_acquire);
+            if (h - tail_seen == N)
+                return false;
+        }
+        items[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+
+        if ((pushes++ & (RING_DEPTH_SAMPLE - 1)) == 0) {
+            size_t depth = h + 1 - tail.load(std::memory_order_relaxed);
+            depth_samples++;
+            depth_total += depth;
+            if (depth > max_depth) max_depth = depth;
+        }
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head_seen) {
+            head_seen = head.load(std::memory_order_acquire);
+            if (t == head_seen)
+                return false;
+        }
+        item = items[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+};
+
+#endif
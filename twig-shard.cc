@@ -0,0 +1,239 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "twig-shard.h"
+#include "twig-clock.h"
+#include "twig-wait.h"
+
+uint32_t flow_hash(const char *frame, size_t caplen)
+{
+	// Anything that isn't IPv4 (ARP mostly) goes by the sender's MAC so it still sticks to one worker
+	const eth_hdr *eh = (const eth_hdr *)frame;
+	uint32_t h;
+	if (caplen >= sizeof(eth_hdr) + sizeof(IPv4) && byteswap16(eh->type) == 0x0800) {
+		const IPv4 *ip = (const IPv4 *)(frame + sizeof(eth_hdr));
+		uint32_t src, dst, ports = 0;
+		memcpy(&src, ip->src, 4);
+		memcpy(&dst, ip->dest, 4);
+		const char *l4 = frame + sizeof(eth_hdr) + sizeof(IPv4);
+		if (ip->type == 0x11 && caplen >= sizeof(eth_hdr) + sizeof(IPv4) + sizeof(UDP)) {
+			const UDP *udp = (const UDP *)l4;
+			ports = (uint32_t)udp->sport << 16 | udp->dport;
+		} else if (ip->type == 1 && caplen >= sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP)) {
+			ports = ((const ICMP *)l4)->id;
+		}
+		h = src * 0x9e3779b1u ^ dst;
+		h = h * 0x85ebca6bu ^ ports;
+		h = h * 0xc2b2ae35u ^ ip->type;
+	} else {
+		uint32_t a;
+		uint16_t b;
+		memcpy(&a, eh->src, 4);
+		memcpy(&b, eh->src + 4, 2);
+		h = a * 0x9e3779b1u ^ b;
+	}
+	// murmur3 finalizer, same as the ARP cache
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+void Worker::give_back(Interface *ifc, char *buf)
+{
+	Pipe_Buffer b;
+	b.ifc = ifc;
+	b.buf = buf;
+	while (!spares.push(b)) {
+		spares.full_stalls++;
+		sched_yield();
+	}
+}
+
+static void release_to_reader(void *ctx, char *buf)
+{
+	Interface *shard = (Interface *)ctx;
+	((Worker *)shard->owner)->give_back(shard->parent, buf);
+}
+
+Shard_Set::~Shard_Set()
+{
+	// Shards first, their ARP timers are on their worker's wheel
+	for (size_t i = 0; i < workers.size(); i++) {
+		for (size_t n = 0; n < workers[i]->shards.size(); n++)
+			delete workers[i]->shards[n];
+		delete workers[i];
+	}
+}
+
+void Shard_Set::start(std::vector<Interface *> *ifaces, int nworkers, record_fn handle_record, long deadline_us)
+{
+	interfaces = ifaces;
+	handle = handle_record;
+
+	// One ARP table per interface that every worker learns into and looks up without locking
+	for (size_t n = 0; n < interfaces->size(); n++)
+		(*interfaces)[n]->shared_arp = new Shared_ARP();
+
+	for (int i = 0; i < nworkers; i++) {
+		Worker *w = new Worker();
+		w->id = i;
+		w->waker.init();
+		for (size_t n = 0; n < interfaces->size(); n++) {
+			Interface *shard = (*interfaces)[n]->make_shard(w, &w->timers, deadline_us);
+			shard->replies.set_release(release_to_reader, shard);
+			w->shards.push_back(shard);
+		}
+		workers.push_back(w);
+	}
+
+	for (size_t n = 0; n < interfaces->size(); n++) {
+		Interface *ifc = (*interfaces)[n];
+		ifc->handing_off = true;
+		delete ifc->arp; // the shards learn into shared_arp now
+		ifc->arp = NULL;
+		if (ifc->record_buffer) {
+			ifc->pool.put(ifc->record_buffer);
+			ifc->record_buffer = NULL;
+		}
+	}
+
+	start_stage_threads([this]() {
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i]->thread = std::thread(&Shard_Set::worker_loop, this, workers[i]);
+	});
+}
+
+void Shard_Set::push_frame(Interface *ifc, char *record, const pcap_pkthdr &pph)
+{
+	Worker *w = workers[flow_hash(record + sizeof(pcap_pkthdr), pph.caplen) % workers.size()];
+	Pipe_Frame f;
+	f.ifc = ifc;
+	f.record = record;
+	f.pph = pph;
+	if (!w->frames.push(f)) {
+		w->frames.full_stalls++;
+		do {
+			recycle();
+			sched_yield();
+		} while (!w->frames.push(f));
+	}
+	w->waker.poke();
+}
+
+void Shard_Set::recycle()
+{
+	Pipe_Buffer b;
+	for (size_t i = 0; i < workers.size(); i++)
+		while (workers[i]->spares.pop(b))
+			b.ifc->take_back(b.buf);
+}
+
+void Shard_Set::worker_loop(Worker *w)
+{
+	loop_clock.refresh();
+	w->timers.start(loop_clock.mono_ns);
+
+	int since_tick = 0;
+	while (true) {
+		Pipe_Frame f;
+		if (w->frames.pop(f)) {
+			Interface *shard = w->shards[f.ifc->index];
+			handle(shard, f.record, f.pph);
+			// No reply was built on it, so it can go straight back
+			if (!shard->replies.holding(f.record))
+				w->give_back(f.ifc, f.record);
+			if (shard->replies.replies)
+				shard->replies.check_deadline();
+			if (++since_tick >= CLOCK_REFRESH_RECORDS) {
+				since_tick = 0;
+				loop_clock.refresh();
+				w->timers.advance(loop_clock.mono_ns);
+			}
+			continue;
+		}
+
+		for (size_t n = 0; n < w->shards.size(); n++)
+			if (w->shards[n]->replies.replies)
+				w->shards[n]->replies.check_deadline();
+
+		if (reader_done.load(std::memory_order_acquire) && w->frames.empty())
+			break;
+
+		w->frames.empty_waits++;
+		auto ready = [this, w] { return !w->frames.empty() || reader_done.load(std::memory_order_acquire); };
+		if (w->waker.spin(ready))
+			continue;
+		for (size_t n = 0; n < w->shards.size(); n++)
+			w->shards[n]->replies.flush(FLUSH_IDLE);
+		w->waker.wait(ready, WAIT_TIMEOUT_MS);
+		loop_clock.refresh(); // the ARP timers still have to run when nothing's arriving
+		w->timers.advance(loop_clock.mono_ns);
+		since_tick = 0;
+	}
+
+	for (size_t n = 0; n < w->shards.size(); n++)
+		w->shards[n]->stop();
+	fold_stats();
+	workers_done.fetch_add(1, std::memory_order_release);
+}
+
+void Shard_Set::finish()
+{
+	reader_done.store(true, std::memory_order_release);
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i]->waker.poke();
+
+	// The workers' last flushes hand back every buffer they held, so keep taking them
+	while (workers_done.load(std::memory_order_acquire) < (int)workers.size()) {
+		recycle();
+		usleep(100);
+	}
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i]->thread.join();
+	recycle();
+
+	// Fold the shards' counters back into the interfaces they came from
+	for (size_t i = 0; i < workers.size(); i++) {
+		for (size_t n = 0; n < workers[i]->shards.size(); n++) {
+			Interface *shard = workers[i]->shards[n];
+			Iface_Counters &c = shard->parent->counters;
+			c.records += shard->counters.records;
+			c.bytes += shard->counters.bytes;
+			c.icmp_packets += shard->counters.icmp_packets;
+			c.udp_packets += shard->counters.udp_packets;
+			c.icmp_replies += shard->counters.icmp_replies;
+			c.udp_replies += shard->counters.udp_replies;
+			c.udp_unknown += shard->counters.udp_unknown;
+			c.arp_packets += shard->counters.arp_packets;
+			c.oversize_drops += shard->counters.oversize_drops;
+			Header_Cache &h = shard->parent->headers;
+			h.hits += shard->headers.hits;
+			h.misses += shard->headers.misses;
+			h.evictions += shard->headers.evictions;
+		}
+	}
+}
+
+void Shard_Set::print_stats(FILE *out) const
+{
+	fprintf(out, "### workers ###\n");
+	for (size_t i = 0; i < workers.size(); i++) {
+		const Worker *w = workers[i];
+		uint64_t replies = 0, arp = 0;
+		for (size_t n = 0; n < w->shards.size(); n++) {
+			replies += w->shards[n]->counters.icmp_replies + w->shards[n]->counters.udp_replies;
+			arp += w->shards[n]->arp->inserts;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "worker %zu", i);
+		fprintf(out, "%-20s %" PRIu64 " frames, %" PRIu64 " replies, %" PRIu64 " arp learned, depth avg=%.1f max=%" PRIu64
+			", %" PRIu64 " full stalls, %" PRIu64 " sleeps\n", name, w->frames.pushes, replies, arp,
+			w->frames.depth_samples ? (double)w->frames.depth_total / w->frames.depth_samples : 0.0,
+			w->frames.max_depth, w->frames.full_stalls, w->waker.sleeps);
+	}
+	fflush(out);
+}
@@ -0,0 +1,75 @@
+#ifndef TWIG_SHARD_H
+#define TWIG_SHARD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "twig-utils.h"
+#include "twig-ring.h"
+#include "twig-iface.h"
+#include "twig-timer.h"
+#include "twig-pipeline.h"
+
+/*
+ * Sharded mode (-w N).
+ *
+ * The reader (main thread) hashes each packet's IPv4 5-tuple (ICMP uses the
+ * echo id in place of the ports) and hands it to one of N workers. Everything
+ * a packet touches after that belongs to its worker: a shard of every
+ * interface with its own ARP cache, reply batch and counters, plus the
+ * worker's own loop clock, timer wheel and stats. So the workers share
+ * nothing mutable on the hot path.
+ *
+ * Every packet of a flow goes to the same worker, and a worker answers in
+ * order, so replies within a flow stay in order. Each worker appends its own
+ * batches. The capture files are O_APPEND, so every writev() lands whole at
+ * the end even when two workers write at once. Different flows can end up
+ * interleaved in the file.
+ *
+ * Buffers still come from the reader's pools and go back on a spare ring per
+ * worker, just like -p.
+ */
+
+#define SHARD_MAX_WORKERS 64
+
+struct Worker {
+    int id;
+    Spsc_Ring<Pipe_Frame, PIPE_RING_SIZE> frames;    // reader -> this worker
+    Spsc_Ring<Pipe_Buffer, PIPE_RETURN_SIZE> spares; // this worker -> reader
+    Stage_Waker waker;
+    std::vector<Interface *> shards;  // indexed by Interface::index
+    Timer_Wheel timers;
+    std::thread thread;
+
+    Worker() : id(0) {}
+    void give_back(Interface *ifc, char *buf);
+};
+
+struct Shard_Set {
+    std::vector<Worker *> workers;
+    std::vector<Interface *> *interfaces;
+    record_fn handle;
+    std::atomic<bool> reader_done;
+    std::atomic<int> workers_done;
+
+    Shard_Set() : interfaces(NULL), handle(NULL), reader_done(false), workers_done(0) {}
+    ~Shard_Set();
+
+    void start(std::vector<Interface *> *ifaces, int nworkers, record_fn handle_record, long deadline_us);
+
+    // reader
+    void push_frame(Interface *ifc, char *record, const pcap_pkthdr &pph);
+    void recycle();
+    void finish(); // no more frames; wait for the workers, then add their counters to the interfaces'
+
+    void print_stats(FILE *out) const;
+
+private:
+    void worker_loop(Worker *w);
+};
+
+uint32_t flow_hash(const char *frame, size_t caplen);
+
+#endif
@@ -0,0 +1,82 @@
+#include <time.h>
+#include <inttypes.h>
+#include <mutex>
+#include "twig-stats.h"
+
+thread_local Twig_Stats stats;
+uint64_t last_wake_ns;
+
+static Twig_Stats totals;
+static std::mutex totals_lock;
+
+uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void note_reply_sent()
+{
+	// Only count replies to packets we were woken up for, the startup backlog
+	// would just skew the numbers
+	// (with -p/-w the reader thread sets it and some other thread writes the reply)
+	// Only the first reply after each wakeup takes the stamp: during a long busy
+	// stretch later ones would be measured from an ever older wakeup
+	uint64_t woke = __atomic_exchange_n(&last_wake_ns, 0, __ATOMIC_RELAXED);
+	if (woke)
+		stats.wake_to_reply.add(now_ns() - woke);
+}
+
+static void print_latency(FILE *out, const char *name, const Latency_Counter &lc)
+{
+	if (lc.count == 0) {
+		fprintf(out, "%-20s n=0\n", name);
+		return;
+	}
+	fprintf(out, "%-20s n=%" PRIu64 " avg=%.1fus max=%.1fus\n", name, lc.count,
+		lc.total_ns / 1000.0 / lc.count, lc.max_ns / 1000.0);
+}
+
+void fold_stats()
+{
+	std::lock_guard<std::mutex> hold(totals_lock);
+	totals.wakeups += stats.wakeups;
+	totals.wakeup_timeouts += stats.wakeup_timeouts;
+	totals.wake_to_reply.add(stats.wake_to_reply);
+	totals.pool_mallocs += stats.pool_mallocs;
+	totals.pool_bytes += stats.pool_bytes;
+	totals.pool_gets += stats.pool_gets;
+	if (stats.pool_peak > totals.pool_peak)
+		totals.pool_peak = stats.pool_peak;
+	for (int i = 0; i < FLUSH_REASONS; i++)
+		totals.flushes[i] += stats.flushes[i];
+	totals.batched_replies += stats.batched_replies;
+	if (stats.batch_max > totals.batch_max)
+		totals.batch_max = stats.batch_max;
+	stats = Twig_Stats();
+}
+
+void print_stats(FILE *out)
+{
+	fold_stats();
+	const Twig_Stats &stats = totals;
+
+	fprintf(out, "### twig stats ###\n");
+	fprintf(out, "%-20s %" PRIu64 "\n", "wakeups", stats.wakeups);
+	fprintf(out, "%-20s %" PRIu64 "\n", "wakeup timeouts", stats.wakeup_timeouts);
+	print_latency(out, "wakeup->reply", stats.wake_to_reply);
+	fprintf(out, "%-20s %" PRIu64 " (%" PRIu64 " bytes)\n", "pool mallocs", stats.pool_mallocs, stats.pool_bytes);
+	fprintf(out, "%-20s %" PRIu64 "\n", "pool gets", stats.pool_gets);
+	fprintf(out, "%-20s %" PRIu64 "\n", "pool peak in use", stats.pool_peak);
+
+	uint64_t batches = 0;
+	for (int i = 0; i < FLUSH_REASONS; i++)
+		batches += stats.flushes[i];
+	fprintf(out, "%-20s %" PRIu64 " (full %" PRIu64 ", deadline %" PRIu64 ", idle %" PRIu64 ", exit %" PRIu64 ")\n",
+		"reply batches", batches, stats.flushes[FLUSH_FULL], stats.flushes[FLUSH_DEADLINE],
+		stats.flushes[FLUSH_IDLE], stats.flushes[FLUSH_EXIT]);
+	fprintf(out, "%-20s avg=%.1f max=%" PRIu64 "\n", "replies per batch",
+		batches ? (double)stats.batched_replies / batches : 0.0, stats.batch_max);
+	fflush(out);
+}
@@ -0,0 +1,66 @@
+#ifndef TWIG_STATS_H
+#define TWIG_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Counters for seeing what twig is actually doing. These are bumped on the
+ * hot path, so keep them as plain integers and only format them at exit.
+ *
+ * Every thread counts into its own copy (so -p/-w threads never share a
+ * counter) and folds it into the process totals when it finishes.
+ */
+
+// Why a batch of replies got written out (see twig-batch.h)
+enum Flush_Reason { FLUSH_FULL, FLUSH_DEADLINE, FLUSH_IDLE, FLUSH_EXIT, FLUSH_REASONS };
+
+struct Latency_Counter {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+
+    constexpr Latency_Counter() : count(0), total_ns(0), max_ns(0) {}
+    void add(uint64_t ns) {
+        count++;
+        total_ns += ns;
+        if (ns > max_ns) max_ns = ns;
+    }
+    void add(const Latency_Counter &o) {
+        count += o.count;
+        total_ns += o.total_ns;
+        if (o.max_ns > max_ns) max_ns = o.max_ns;
+    }
+};
+
+struct Twig_Stats {
+    uint64_t wakeups;         // woken up by an inotify event on the capture file
+    uint64_t wakeup_timeouts; // woken up by the fallback timeout instead
+    Latency_Counter wake_to_reply; // event wakeup -> reply written
+
+    uint64_t pool_mallocs;    // allocator calls made by the packet buffer pool
+    uint64_t pool_bytes;      // bytes those calls asked for
+    uint64_t pool_gets;       // buffers handed out
+    uint64_t pool_peak;       // most buffers in use at once
+
+    uint64_t flushes[FLUSH_REASONS];      // reply batch flushes, indexed by Flush_Reason
+    uint64_t batched_replies; // replies written by those flushes
+    uint64_t batch_max;       // biggest batch
+
+    constexpr Twig_Stats() : wakeups(0), wakeup_timeouts(0),
+        pool_mallocs(0), pool_bytes(0), pool_gets(0), pool_peak(0),
+        flushes(), batched_replies(0), batch_max(0) {}
+};
+
+extern thread_local Twig_Stats stats;
+extern uint64_t last_wake_ns; // monotonic time of the last event wakeup (0 = none, or already measured), used with __atomic
+
+uint64_t now_ns(); // CLOCK_MONOTONIC in nanoseconds
+
+void note_reply_sent(); // call after a reply hits the capture file; the first one after a wakeup is timed
+
+void fold_stats(); // add this thread's counters to the totals, call it as the thread finishes
+
+void print_stats(FILE *out); // folds the calling thread's counters too
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "twig-stream.h"
+
+#define READ_DATA 1   // user_data of the read ahead
+#define READ_CANCEL 2 // and of cancelling it
+
+void Pcap_Stream::init(int file_fd, uint64_t file_offset, size_t max_caplen, bool swapped, bool want_uring)
+{
+	fd = file_fd;
+	offset = file_offset;
+	snaplen = max_caplen;
+	byteswap = swapped;
+	ring = want_uring ? uring_open() : NULL;
+
+	if (ring == NULL) {
+		buf = (char *)malloc(STREAM_CHUNK);
+		start = end = 0;
+	} else {
+		bufs[0] = (char *)malloc(STREAM_HEADROOM + STREAM_CHUNK);
+		bufs[1] = (char *)malloc(STREAM_HEADROOM + STREAM_CHUNK);
+		buf = bufs[0] && bufs[1] ? bufs[0] : NULL;
+		start = end = STREAM_HEADROOM;
+	}
+	if (buf == NULL) {
+		perror("stream buffer");
+		exit(1);
+	}
+}
+
+void Pcap_Stream::read_ahead()
+{
+	char *into = buf == bufs[0] ? bufs[1] : bufs[0];
+	io_uring_sqe *sqe = ring->get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1; // from the file position, like read()
+	sqe->addr = (uintptr_t)(into + STREAM_HEADROOM);
+	sqe->len = STREAM_CHUNK;
+	sqe->user_data = READ_DATA;
+	ring->submit(); // if a signal gets in the way, reap() submits it
+	reading = true;
+}
+
+bool Pcap_Stream::fill_ring()
+{
+	if (!reading)
+		read_ahead(); // nothing queued: we're just starting, or the last one found the end of the file
+
+	io_uring_cqe cqe;
+	if (!ring->reap(&cqe, true))
+		return false; // a signal, it's still in flight for next time
+	reading = false;
+	reads++;
+	if (cqe.res <= 0) {
+		if (cqe.res < 0) {
+			errno = -cqe.res;
+			perror("read capture file");
+		}
+		return false;
+	}
+
+	// Carry the partial record over in front of the new chunk, then read ahead into the old buffer
+	char *next = buf == bufs[0] ? bufs[1] : bufs[0];
+	size_t left = end - start;
+	memcpy(next + STREAM_HEADROOM - left, buf + start, left);
+	buf = next;
+	start = STREAM_HEADROOM - left;
+	end = STREAM_HEADROOM + cqe.res;
+	read_ahead();
+	return true;
+}
+
+bool Pcap_Stream::fill()
+{
+	if (ring)
+		return fill_ring();
+
+	// Slide whatever's left of a partial record to the front so there's room for a whole chunk
+	if (start == end) {
+		start = end = 0;
+	} else if (start > 0) {
+		memmove(buf, buf + start, end - start);
+		end -= start;
+		start = 0;
+	}
+
+	ssize_t ret = read(fd, buf + end, STREAM_CHUNK - end);
+	reads++;
+	if (ret <= 0) {
+		if (ret < 0 && errno != EINTR) // a signal, the main loop will see it
+			perror("read capture file");
+		return false;
+	}
+	end += ret;
+	return true;
+}
+
+char *Pcap_Stream::next(pcap_pkthdr *pph, char *dest)
+{
+	while (true) {
+		if (skip) {
+			// The rest of an oversize record, throw it away as it arrives
+			size_t n = end - start < skip ? end - start : skip;
+			start += n;
+			skip -= n;
+			if (skip && !fill())
+				return NULL;
+			continue;
+		}
+
+		if (end - start < sizeof(pcap_pkthdr)) {
+			if (!fill())
+				return NULL;
+			continue;
+		}
+
+		memcpy(pph, buf + start, sizeof(*pph));
+		if (byteswap) {
+			pph->ts_secs = byteswap32(pph->ts_secs);
+			pph->ts_usecs = byteswap32(pph->ts_usecs);
+			pph->caplen = byteswap32(pph->caplen);
+			pph->len = byteswap32(pph->len);
+		}
+
+		if (pph->caplen > snaplen) {
+			// Won't fit a buffer (and couldn't have been captured with this snaplen), skip it
+			oversize++;
+			start += sizeof(*pph);
+			skip = pph->caplen;
+			offset += sizeof(*pph) + pph->caplen;
+			continue;
+		}
+
+		size_t size = sizeof(*pph) + pph->caplen;
+		if (end - start < size) {
+			// Still being written, come back for it once there's more
+			if (!fill())
+				return NULL;
+			continue;
+		}
+
+		memcpy(dest, buf + start, size);
+		start += size;
+		offset += size;
+		return dest;
+	}
+}
+
+void Pcap_Stream::close_stream()
+{
+	if (ring) {
+		// The kernel mustn't still be reading into a buffer we're about to free (stdin can leave one waiting)
+		if (reading) {
+			io_uring_sqe *sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = READ_DATA;
+			sqe->user_data = READ_CANCEL;
+			ring->submit();
+			io_uring_cqe cqe;
+			while (ring->reap(&cqe, true) && cqe.user_data != READ_DATA)
+				;
+			reading = false;
+		}
+		ring->close_ring(); // kept for its counters, deleted with the stream
+		free(bufs[0]);
+		free(bufs[1]);
+		bufs[0] = bufs[1] = NULL;
+	} else {
+		free(buf);
+	}
+	buf = NULL;
+	start = end = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef TWIG_STREAM_H
+#define TWIG_STREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "twig-utils.h"
+#include "twig-pool.h"
+#include "twig-uring.h"
+
+/*
+ * Buffered pcap reader (the read() path, when -m isn't used or can't be).
+ *
+ * Instead of a read() for every record header and another for its packet,
+ * read() STREAM_CHUNK bytes at a time and hand out as many complete records
+ * as that holds. A record the shim is still in the middle of writing stays
+ * in the buffer until the rest of it shows up, so a half-written record is
+ * no longer mistaken for a broken file.
+ *
+ * Records are copied out of the buffer into the caller's pool buffer, since
+ * replies get built on top of the request and handed off to other threads.
+ *
+ * With -u the reads go through io_uring and there are two buffers: while
+ * records are taken out of one, the next chunk is already being read into
+ * the other. Each buffer starts with STREAM_HEADROOM spare bytes so the
+ * partial record left at the end of one can be copied in front of the
+ * chunk that continues it.
+ */
+
+#define STREAM_CHUNK (1 << 20) // bytes per read(), comfortably more than the biggest record
+
+#define STREAM_HEADROOM (sizeof(pcap_pkthdr) + POOL_MAX_SNAPLEN) // the most of a record that can be left over
+
+static_assert(STREAM_CHUNK >= STREAM_HEADROOM, "a whole record has to fit the buffer");
+
+struct Pcap_Stream {
+    int fd;
+    char *buf;
+    size_t start;     // next unparsed byte in buf
+    size_t end;       // end of what's been read into buf
+    size_t snaplen;   // records bigger than this are skipped (they won't fit a pool buffer)
+    uint64_t skip;    // bytes left of an oversize record we're skipping
+    bool byteswap;    // record headers are in the other byte order
+    uint64_t reads;   // read() calls
+    uint64_t oversize; // records skipped for being bigger than snaplen
+    uint64_t offset;  // file offset of the next record
+    Uring *ring;      // -u: reads go through this, NULL = read()
+    char *bufs[2];    // -u: buf is one of these, the read ahead goes into the other
+    bool reading;     // -u: there's a read in flight into the other one
+
+    Pcap_Stream() : fd(-1), buf(NULL), start(0), end(0), snaplen(0), skip(0), byteswap(false), reads(0), oversize(0),
+        offset(0), ring(NULL), bufs(), reading(false) {}
+    ~Pcap_Stream() { delete ring; }
+
+    void init(int file_fd, uint64_t file_offset, size_t max_caplen, bool swapped, bool want_uring);
+    // Next complete record copied into dest (pph in host order), NULL once we've caught up with the file
+    char *next(pcap_pkthdr *pph, char *dest);
+    size_t pending() const { return end - start; } // bytes of a record that isn't all there yet
+    void close_stream();
+
+private:
+    bool fill(); // read() more onto the end, true if anything came
+    bool fill_ring(); // -u: switch to the buffer that was read ahead into, true if anything came
+    void read_ahead();
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include <inttypes.h>
+#include "twig-timer.h"
+
+static void list_init(Timer *head)
+{
+	head->next = head->prev = head;
+}
+
+static void list_add(Timer *head, Timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_del(Timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+Timer_Wheel::Timer_Wheel() : now_tick(0), pending(0), fired(0), cascaded(0)
+{
+	for (int l = 0; l < TIMER_LEVELS; l++)
+		for (int s = 0; s < TIMER_SLOTS; s++)
+			list_init(&slots[l][s]);
+}
+
+void Timer_Wheel::start(uint64_t now_ns)
+{
+	now_tick = now_ns / TIMER_TICK_NS;
+}
+
+void Timer_Wheel::place(Timer *t, uint64_t earliest)
+{
+	uint64_t delta = t->expires > now_tick ? t->expires - now_tick : 0;
+
+	// Lowest level whose span covers the delay; anything past the top level waits in its last slot
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_BITS * (level + 1))))
+		level++;
+
+	uint64_t when = t->expires;
+	if (delta >= ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)))
+		when = now_tick + ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+	if (when < earliest)
+		when = earliest; // already due
+
+	int slot = (when >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+	list_add(&slots[level][slot], t);
+}
+
+void Timer_Wheel::add(Timer *t, uint64_t expires_ns)
+{
+	if (t->pending())
+		cancel(t);
+	t->expires = expires_ns / TIMER_TICK_NS;
+	place(t, now_tick + 1); // this tick has already run
+	pending++;
+}
+
+void Timer_Wheel::cancel(Timer *t)
+{
+	if (!t->pending())
+		return;
+	list_del(t);
+	pending--;
+}
+
+void Timer_Wheel::cascade(int level)
+{
+	// Everything in this slot is now within the next level down's range, spread it out there
+	int slot = (now_tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+	Timer *head = &slots[level][slot];
+	while (head->next != head) {
+		Timer *t = head->next;
+		list_del(t);
+		place(t, now_tick); // level 0 for this tick runs right after the cascade
+		cascaded++;
+	}
+}
+
+void Timer_Wheel::advance(uint64_t now_ns)
+{
+	uint64_t target = now_ns / TIMER_TICK_NS;
+
+	while (now_tick < target) {
+		if (pending == 0) {
+			now_tick = target; // nothing to run, skip straight there
+			break;
+		}
+		now_tick++;
+
+		// When a level's index wraps, pull the next slot of the level above down
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if ((now_tick & (((uint64_t)1 << (TIMER_BITS * level)) - 1)) != 0)
+				break;
+			cascade(level);
+		}
+
+		Timer *head = &slots[0][now_tick & (TIMER_SLOTS - 1)];
+		while (head->next != head) {
+			Timer *t = head->next;
+			list_del(t);
+			pending--;
+			if (t->expires > now_tick) {
+				// Parked at the far end of the top level, not actually due yet
+				place(t, now_tick + 1);
+				pending++;
+				continue;
+			}
+			fired++;
+			t->fn(t); // may re-add t
+		}
+	}
+}
+
+void Timer_Wheel::print_stats(FILE *out) const
+{
+	fprintf(out, "%-20s %" PRIu64 " fired, %" PRIu64 " cascaded, %" PRIu64 " pending\n", "timers",
+		fired, cascaded, pending);
+}
@@ -0,0 +1,62 @@
+#ifndef TWIG_TIMER_H
+#define TWIG_TIMER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Hierarchical timing wheel.
+ *
+ * TIMER_LEVELS wheels of TIMER_SLOTS slots each; level 0 slots are one tick
+ * wide, level 1 slots are TIMER_SLOTS ticks wide and so on. Adding or
+ * cancelling a timer is a list insert/unlink, and a timer is only touched again
+ * when its level's slot comes up (it then drops down a level, at most
+ * TIMER_LEVELS - 1 times). Driven by the main loop's clock through advance(),
+ * so nothing here reads the time itself.
+ *
+ * Timers are intrusive: the owner embeds (or pools) a Timer and fills in fn/arg/key.
+ */
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_TICK_NS 10000000ull // 10 ms, so the wheel covers 64^4 ticks (~46 hours)
+
+struct Timer;
+typedef void (*timer_fn)(Timer *t);
+
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires; // in ticks
+    timer_fn fn;
+    void *arg;        // owner's context
+    uint64_t key;     // owner's data (e.g. which entry this is for)
+
+    Timer() : next(NULL), prev(NULL), expires(0), fn(NULL), arg(NULL), key(0) {}
+    bool pending() const { return next != NULL; }
+};
+
+struct Timer_Wheel {
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+    uint64_t now_tick;
+    uint64_t pending;
+
+    // stats
+    uint64_t fired;
+    uint64_t cascaded;
+
+    Timer_Wheel();
+
+    void start(uint64_t now_ns);
+    void add(Timer *t, uint64_t expires_ns);
+    void cancel(Timer *t);
+    void advance(uint64_t now_ns); // run everything that's due
+    void print_stats(FILE *out) const;
+
+private:
+    void place(Timer *t, uint64_t earliest);
+    void cascade(int level);
+};
+
+#endif
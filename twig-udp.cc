@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+#include "twig-udp.h"
+#include "twig-clock.h"
+#include "twig-metrics.h"
+
+UDP_Registry udp_services; // zeroed, nothing registered until main() does it
+
+void UDP_Registry::add(u_short port, const UDP_Service *service)
+{
+	if (ports[port]) {
+		fprintf(stderr, "UDP port %u already has the %s service\n", port, ports[port]->name);
+		exit(1);
+	}
+	ports[port] = service;
+	metrics_watch_udp_port(port);
+}
+
+void UDP_Registry::print(FILE *out) const
+{
+	for (int port = 0; port < 65536; port++)
+		if (ports[port])
+			fprintf(out, "\tUDP %d: %s\n", port, ports[port]->name);
+}
+
+static bool udp_echo(const UDP_Request &, UDP_Reply *)
+{
+	return true; // the default reply is already the request's payload
+}
+
+static bool udp_time(const UDP_Request &, UDP_Reply *reply)
+{
+	// populate the payload with the current time, already in RFC 868 form
+	uint32_t now = loop_clock.rfc868;
+	memcpy(reply->buf, &now, sizeof(now)); // the request's payload doesn't matter
+	reply->payload = reply->buf;
+	reply->size = sizeof(now);
+	reply->rewritten = true;
+	return true;
+}
+
+const UDP_Service udp_echo_service = { "echo", udp_echo };
+const UDP_Service udp_time_service = { "time", udp_time };
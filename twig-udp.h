@@ -0,0 +1,64 @@
+#ifndef TWIG_UDP_H
+#define TWIG_UDP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "twig-utils.h"
+
+/*
+ * UDP services.
+ *
+ * A service is registered against a port at startup and do_UDP finds it with
+ * one array index (every port has a slot, 512KB of pointers that are almost all
+ * NULL). Requests for ports nobody registered are dropped and counted.
+ *
+ * do_UDP does the parsing and the header work (swapping addresses and ports,
+ * lengths, IP checksum), so a handler only deals with payloads. It gets the
+ * request's payload and a reply that by default echoes it back. To send
+ * something else, write it to reply->buf (room bytes), then point payload at
+ * it and set rewritten so the UDP checksum gets redone. reply->buf can be the
+ * request payload itself (replies are built in place), so read what you need
+ * first. Return false to send nothing.
+ *
+ * Handlers run on whichever thread handles the packet (-p, -w), so they must
+ * not keep state of their own.
+ */
+
+#define UDP_PORT_ECHO 7   // RFC 862
+#define UDP_PORT_TIME 37  // RFC 868
+
+struct UDP_Request {
+    const UDP_packet *packet;
+    u_short sport;        // host order
+    u_short dport;
+    const char *payload;
+    size_t size;          // payload bytes (IP length, not the capture's padding)
+};
+
+struct UDP_Reply {
+    char *buf;            // where a new payload can go
+    size_t room;
+    const char *payload;  // what gets sent, the request's payload unless the handler changes it
+    size_t size;
+    bool rewritten;       // payload isn't the request's any more, checksum it from scratch
+};
+
+struct UDP_Service {
+    const char *name;
+    bool (*handle)(const UDP_Request &req, UDP_Reply *reply);
+};
+
+struct UDP_Registry {
+    const UDP_Service *ports[65536];
+
+    void add(u_short port, const UDP_Service *service);
+    const UDP_Service *find(u_short port) const { return ports[port]; }
+    void print(FILE *out) const;
+};
+
+extern UDP_Registry udp_services;
+
+extern const UDP_Service udp_echo_service;
+extern const UDP_Service udp_time_service;
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "twig-uring.h"
+
+static int uring_setup(unsigned entries, io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+bool Uring::init(unsigned entries)
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	fd = uring_setup(entries, &p);
+	if (fd < 0)
+		return false;
+
+	// Reads and writes at the file position (offset -1) are what we need, and came with IORING_OP_READ
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		fd = -1;
+		errno = ENOSYS;
+		return false;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+	sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		sq_ptr = NULL;
+		close_ring();
+		return false;
+	}
+	if (single) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			cq_ptr = NULL;
+			close_ring();
+			return false;
+		}
+	}
+	sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+	void *s = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (s == MAP_FAILED) {
+		close_ring();
+		return false;
+	}
+	sqes = (io_uring_sqe *)s;
+
+	char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+	sq_entries = p.sq_entries;
+	local_tail = *sq_tail;
+	return true;
+}
+
+io_uring_sqe *Uring::get_sqe()
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (local_tail - head >= sq_entries)
+		return NULL;
+	unsigned i = local_tail & *sq_mask;
+	io_uring_sqe *sqe = &sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[i] = i;
+	local_tail++;
+	return sqe;
+}
+
+bool Uring::submit()
+{
+	__atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+	while (true) {
+		// Whatever the kernel hasn't taken yet (it moves sq_head as it does)
+		unsigned left = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (left == 0)
+			return true;
+		submits++;
+		int ret = uring_enter(fd, left, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				return false;
+			if (errno == EAGAIN || errno == EBUSY)
+				continue; // out of kernel memory for a moment, or the CQ is full; try again
+			perror("io_uring_enter");
+			return false;
+		}
+	}
+}
+
+bool Uring::reap(io_uring_cqe *cqe, bool wait)
+{
+	while (true) {
+		unsigned head = *cq_head; // only we move it
+		if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			*cqe = cqes[head & *cq_mask];
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+		if (!wait)
+			return false;
+		waits++;
+		submits++;
+		unsigned left = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (uring_enter(fd, left, 1, IORING_ENTER_GETEVENTS) < 0) {
+			if (errno == EINTR)
+				return false;
+			if (errno == EAGAIN || errno == EBUSY)
+				continue;
+			perror("io_uring_enter");
+			exit(1); // the request is lost to us, there's no telling where the file got to
+		}
+	}
+}
+
+void Uring::close_ring()
+{
+	if (sqes)
+		munmap(sqes, sqes_len);
+	if (cq_ptr && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_len);
+	if (sq_ptr)
+		munmap(sq_ptr, sq_len);
+	if (fd >= 0)
+		close(fd);
+	sqes = NULL;
+	sq_ptr = cq_ptr = NULL;
+	fd = -1;
+}
+
+Uring *uring_open()
+{
+	Uring *ring = new Uring();
+	if (!ring->init(URING_ENTRIES)) {
+		delete ring;
+		return NULL;
+	}
+	return ring;
+}
+
+bool uring_available()
+{
+	static int available = -1;
+	if (available < 0) {
+		Uring *ring = uring_open();
+		available = ring != NULL;
+		if (ring == NULL)
+			perror("io_uring");
+		else
+			ring->close_ring();
+		delete ring;
+	}
+	return available;
+}
@@ -0,0 +1,48 @@
+#ifndef TWIG_URING_H
+#define TWIG_URING_H
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough io_uring for twig (-u), straight on the syscalls since
+ * liburing isn't something we can count on being installed.
+ *
+ * Each user (a Pcap_Stream's reads, a Reply_Batch's writes) gets its own
+ * small ring, so there's never more than one thread on a ring and a
+ * completion always belongs to whoever's reaping it. The point isn't
+ * thousands of requests in flight, it's getting the one read or write twig
+ * would have blocked in off the packet thread while it does something else.
+ */
+
+#define URING_ENTRIES 4
+
+struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned local_tail;  // sqes handed out, published by submit()
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    uint64_t submits;     // io_uring_enter() calls
+    uint64_t waits;       // times a completion wasn't there yet and we had to block for it
+
+    Uring() : fd(-1), sq_head(NULL), sq_tail(NULL), sq_mask(NULL), sq_array(NULL), cq_head(NULL), cq_tail(NULL),
+        cq_mask(NULL), sqes(NULL), cqes(NULL), sq_entries(0), local_tail(0), sq_ptr(NULL), cq_ptr(NULL),
+        sq_len(0), cq_len(0), sqes_len(0), submits(0), waits(0) {}
+
+    bool init(unsigned entries);
+    io_uring_sqe *get_sqe();   // cleared, or NULL if the ring is full
+    bool submit();             // hand the kernel everything from get_sqe(), false if interrupted
+    // The next completion; with wait, block for it (false only if a signal came first)
+    bool reap(io_uring_cqe *cqe, bool wait);
+    void close_ring();
+};
+
+Uring *uring_open(); // a new ring, or NULL if this kernel won't give us one
+bool uring_available(); // checks once that there's io_uring with what we need (5.6+)
+
+#endif
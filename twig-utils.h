@@ -1,6 +1,7 @@
 #ifndef TWIG_UTILS_H
 #define TWIG_UTILS_H
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
 #include <fcntl.h>
@@ -52,6 +53,15 @@ struct pcap_pkthdr
 };
 
 
+inline u_int16_t byteswap16(u_int16_t val) {
+	return (val << 8) | (val >> 8);
+}
+
+inline u_int32_t byteswap32(u_int32_t val) {
+	return ((val << 24) & 0xFF000000) | ((val << 8) & 0x00FF0000) | ((val >> 8) & 0x0000FF00) | (val >> 24);
+}
+
+
 struct eth_hdr {
     /* create this structure */
 	
@@ -134,35 +144,59 @@ struct __attribute__((__packed__)) UDP_packet { // thank you Silas
     char payload[65535]; // Flexible array member for UDP payload
 };
 
-struct ARP_Entry {
-    u_char mac[6]; // MAC address
-    u_char ip[4];  // IP address
-    time_t last_seen; // Last seen time
-};
+/*
+ * Per-thread counter blocks (-S, the latency histograms). Each thread claims
+ * its own the first time it counts, so counting never shares a cache line or
+ * takes a lock, and some other thread adds them all up. Blocks are never
+ * freed: they may still be added up after their thread is gone. Threads
+ * past Max share one overflow block and can lose counts.
+ */
+template <typename T, int Max>
+struct Thread_Blocks {
+    T *blocks[Max];
+    int count;
+    T overflow;
+
+    T *claim() {
+        int n = __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+        if (n >= Max)
+            return &overflow;
+        T *mine = new T();
+        __atomic_store_n(&blocks[n], mine, __ATOMIC_RELEASE);
+        return mine;
+    }
 
-struct ARP_Cache {
-    ARP_Entry entries[100]; // Array of ARP entries
-    int count; // Number of entries in the cache
-
-    ARP_Cache() : count(0) {} // Constructor to initialize count
-    void add_entry(const u_char* mac, const u_char* ip) {
-        if (count < 100) {
-            // Check if the entry already exists
-            for (int i = 0; i < count; i++) {
-                if (memcmp(entries[i].mac, mac, sizeof(entries[i].mac)) == 0 &&
-                    memcmp(entries[i].ip, ip, sizeof(entries[i].ip)) == 0) {
-                    entries[i].last_seen = time(NULL); // Update the last seen time
-                    return;
-                }
-            }
-
-            // If it doesn't exist, add a new entry
-            memcpy(entries[count].mac, mac, sizeof(entries[count].mac));
-            memcpy(entries[count].ip, ip, sizeof(entries[count].ip));
-            entries[count].last_seen = time(NULL); // Set the last seen time to the current time
-            count++;
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        int n = __atomic_load_n(&count, __ATOMIC_RELAXED);
+        for (int i = 0; i <= n && i <= Max; i++) {
+            const T *block = i < Max ? __atomic_load_n(&blocks[i], __ATOMIC_ACQUIRE) : &overflow;
+            if (block != NULL) // NULL: claimed but not filled in yet
+                fn(*block);
         }
     }
 };
 
+/*
+ * Write a small file by filling in tmp and renaming it over path, so whoever
+ * reads it never sees half of one (-S, the -t sidecar). On failure it says
+ * why and returns false, and the caller just tries again next time: no
+ * reason to stop answering packets over it.
+ */
+template <typename Fn>
+bool replace_file(const char *path, const char *tmp, Fn fill)
+{
+	FILE *out = fopen(tmp, "w");
+	if (out == NULL) {
+		perror(tmp);
+		return false;
+	}
+	fill(out);
+	if (fclose(out) != 0 || rename(tmp, path) != 0) {
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include "twig-wait.h"
+
+bool Tail_Waiter::init()
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		return false;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		return false;
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = inotify_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool Tail_Waiter::add(const char *filename)
+{
+	if (inotify_fd < 0 || inotify_add_watch(inotify_fd, filename, IN_MODIFY) < 0) {
+		polling = true;
+		return false;
+	}
+	watches++;
+	return true;
+}
+
+int Tail_Waiter::wait()
+{
+	if (watches == 0 || inotify_fd < 0) {
+		// No watch, so this is just the old polling delay
+		if (epoll_fd < 0)
+			return usleep(POLL_TIMEOUT_MS * 1000) == 0 ? 0 : -1;
+		epoll_event ev;
+		int n = epoll_wait(epoll_fd, &ev, 1, POLL_TIMEOUT_MS);
+		return n < 0 ? -1 : 0;
+	}
+
+	epoll_event ev;
+	int n = epoll_wait(epoll_fd, &ev, 1, polling ? POLL_TIMEOUT_MS : WAIT_TIMEOUT_MS);
+	if (n < 0)
+		return errno == EINTR ? -1 : 0;
+	if (n == 0)
+		return 0;
+
+	// Drain the queued events, we only care that something happened
+	char events[4096] __attribute__((aligned(__alignof__(inotify_event))));
+	while (read(inotify_fd, events, sizeof(events)) > 0)
+		;
+	return 1;
+}
+
+void Tail_Waiter::close_all()
+{
+	if (inotify_fd >= 0) close(inotify_fd);
+	if (epoll_fd >= 0) close(epoll_fd);
+	inotify_fd = epoll_fd = -1;
+	watches = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef TWIG_WAIT_H
+#define TWIG_WAIT_H
+
+/*
+ * Event-driven wait for the capture file to grow.
+ *
+ * The shim appends packets to the pcap file, so instead of sleeping a fixed
+ * amount and polling read() we put an inotify IN_MODIFY watch on the file and
+ * block in epoll_wait until it fires. The timeout is only a safety net (and the
+ * whole mechanism when inotify can't be used, e.g. reading from stdin).
+ *
+ * Every capture file gets a watch on the same inotify fd, so one epoll_wait
+ * covers all of them; the caller just looks at every file when it wakes up.
+ */
+
+#define WAIT_TIMEOUT_MS 1000  // safety net when the watch is working
+#define POLL_TIMEOUT_MS 3     // old usleep(3000) behaviour when it isn't
+
+struct Tail_Waiter {
+    int inotify_fd;
+    int epoll_fd;
+    int watches;
+    bool polling;  // some file couldn't be watched, so wake up often enough to look at it
+
+    Tail_Waiter() : inotify_fd(-1), epoll_fd(-1), watches(0), polling(false) {}
+
+    bool init();
+    bool add(const char *filename); // false means we're falling back to polling
+    int wait();                      // 1 = file changed, 0 = timed out, -1 = interrupted
+    void close_all();
+};
+
+#endif
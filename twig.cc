@@ -9,63 +9,137 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
-#include <chrono>
+#include <signal.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include "twig-utils.h"
+#include "twig-stats.h"
+#include "twig-wait.h"
+#include "twig-mmap.h"
+#include "twig-uring.h"
+#include "twig-checkpoint.h"
+#include "twig-pool.h"
+#include "twig-batch.h"
+#include "twig-checksum.h"
+#include "twig-arp.h"
+#include "twig-iface.h"
+#include "twig-pipeline.h"
+#include "twig-shard.h"
+#include "twig-clock.h"
+#include "twig-timer.h"
+#include "twig-udp.h"
+#include "twig-latency.h"
+#include "twig-metrics.h"
+#include "twig-log.h"
 #include <arpa/inet.h>
 
 // Global vars
 
-int debug = 0;
-int twig_debug = 0;
-int arp_debug = 0;
+int arp_debug = 0; // -a; -d and -td are log levels now (see twig-log.h)
+int use_mmap = 0; // asked for; each interface falls back to read() on its own if its file can't be mapped
+int use_uring = 0; // -u: capture reads and reply writes through io_uring, when the kernel has it
+long batch_deadline_us = BATCH_DEFAULT_DEADLINE_US;
+int pipelined = 0; // -p: reader, dispatch and writer each get a thread
+int workers = 0; // -w N: packets are hashed by flow across N worker threads
+const char *replay_file = NULL; // -r: read the capture once, as fast as we can, and write the replies here
+const char *stats_file = NULL; // -S: live counters go here, in Prometheus text format
+int start_at_tail = 0; // -t: skip whatever is already in the file
+int use_checkpoint = 0; // -c: resume from (and keep up) filename.offset
 
-int fd = 0; // initiate to 0 as stdin file descriptor (if not stdin then it will be changed)
+volatile sig_atomic_t keep_running = 1;
+volatile sig_atomic_t dump_latency = 0; // SIGUSR1: print the latency histograms so far
 
-bool byteswap = false;
+Timer_Wheel timers; // ARP aging and anything else that needs to happen later
+Pipeline pipeline;
+Shard_Set shards;
 
 
-// Debug function declarations  
+// Debug function declarations (they log at level L, see twig-log.h)
 
-void print_ethernet(struct eth_hdr *peh);
+template <int L> void print_ethernet(struct eth_hdr *peh);
 
-void print_UDP(UDP *udp);
+template <int L> void print_UDP(UDP *udp);
 
-void print_TCP(TCP *tcp);
+template <int L> void print_TCP(TCP *tcp);
 
-void print_IPv4(IPv4 *ipv4);
+template <int L> void print_IPv4(IPv4 *ipv4);
 
-void print_Arp(ARP *arp);
+template <int L> void print_Arp(ARP *arp);
 
-void print_ICMP(ICMP *icmp);
+template <int L> void print_ICMP(ICMP *icmp);
 
-u_int16_t byteswap16(u_int16_t val) {
-	return (val << 8) | (val >> 8);
-};
+void handle_shutdown(int) {
+	keep_running = 0; // main loop notices this after epoll_wait gets interrupted
+}
 
-u_int32_t byteswap32(u_int32_t val) {
-	return ((val << 24) & 0xFF000000) | ((val << 8) & 0x00FF0000) | ((val >> 8) & 0x0000FF00) | (val >> 24);
-};
+void handle_dump(int) {
+	dump_latency = 1; // same, printing from in here isn't safe
+}
 
+void print_usage(char *prog) {
+	fprintf(stdout,"Usage for normal: %s filename\n", prog);
+	fprintf(stdout,"Usage for interface: %s -i [interface]\n", prog);
+	fprintf(stdout,"Usage for several interfaces on one loop: %s -i [interface] -i [interface] ...\n", prog);
+	fprintf(stdout,"Usage for debug types where -d is for full debug and -dt is for twig debug: %s [-d,-td] filename\n", prog);
+	fprintf(stdout,"Usage for ARP cache output (hosts as they're learned, the whole cache at exit): %s -a filename\n", prog);
+	fprintf(stdout,"Usage for debug output on 1 packet in n: %s -L n [-d,-td] filename\n", prog);
+	fprintf(stdout,"Usage for memory-mapped (zero-copy) reading: %s -m filename\n", prog);
+	fprintf(stdout,"Usage for pipelined reader/dispatch/writer threads: %s -p filename\n", prog);
+	fprintf(stdout,"Usage for io_uring reads (queued ahead) and reply writes: %s -u filename\n", prog);
+	fprintf(stdout,"Usage for precise (per-reply) timestamps: %s -P filename\n", prog);
+	fprintf(stdout,"Usage for starting at the end of the file (only answer what arrives from now on): %s -t filename\n", prog);
+	fprintf(stdout,"Usage for resuming where the last run stopped (saved in filename%s): %s -c filename\n", CHECKPOINT_SUFFIX, prog);
+	fprintf(stdout,"Usage for offline replay (read once at full speed, replies to outfile): %s -r outfile filename\n", prog);
+	fprintf(stdout,"Usage for live counters in Prometheus text format, rewritten every %d ms: %s -S statsfile filename\n", METRICS_INTERVAL_MS, prog);
+	fprintf(stdout,"Usage for flow-sharded worker threads (1-%d): %s -w workers filename\n", SHARD_MAX_WORKERS, prog);
+	fprintf(stdout,"Usage for reply batching deadline in microseconds (0 writes every reply right away, default %d): %s -b usecs filename\n", BATCH_DEFAULT_DEADLINE_US, prog);
+	fprintf(stdout,"Flags can be combined, e.g. %s -m -td -i [interface]\n", prog);
+
+	exit(99); // a little extreme but i'll allow it
+}
 
-// Actual function declaration
+void tick_clock() {
+	// The only place the loop reads the time; everything else uses loop_clock
+	loop_clock.refresh();
+	timers.advance(loop_clock.mono_ns);
+}
 
-u_short IPv4_checksum_maker(u_short *buffer, int size);
+bool wait_for_data(Tail_Waiter &waiter) {
+	// Caught up, sleep until the shim appends something (or the timeout fallback)
+	int woke = waiter.wait();
+	if (woke > 0) {
+		stats.wakeups++;
+		__atomic_store_n(&last_wake_ns, now_ns(), __ATOMIC_RELAXED);
+	} else if (woke == 0) {
+		stats.wakeup_timeouts++;
+	}
+	return woke > 0;
+}
 
-// ICMP stuff
 
-void do_ICMP(ICMP_packet *packet, size_t size);
+// Actual function declaration
+
+// ICMP stuff
 
-u_short ICMP_checksum_maker(u_short *buffer, int size);
+void do_ICMP(Interface *ifc, ICMP_packet *packet, size_t size);
 
-void build_and_send_ICMP(ICMP_packet *packet, size_t size);
+void build_and_send_ICMP(Interface *ifc, ICMP_packet *packet, const char *payload, size_t size);
 
 // UDP stuff
 
-void do_UDP(UDP_packet *packet, size_t size);
+void do_UDP(Interface *ifc, UDP_packet *packet, size_t size);
+
+void build_and_send_UDP(Interface *ifc, UDP_packet *packet, const char *payload, size_t size);
+
+// Reply helpers
+
+#define UDP_HEADERS (sizeof(eth_hdr) + sizeof(IPv4) + sizeof(UDP))
+
+size_t ip_payload_size(IPv4 *ip, size_t captured, size_t l4_hdr);
 
-u_short UDP_checksum_maker(u_short *buffer, int size);
+char *reply_headers(Interface *ifc, char *record, size_t hdr_len);
 
-void build_and_send_UDP(UDP_packet *packet, size_t size);
+void send_reply(Interface *ifc, const pcap_pkthdr &pph, const iovec *frame, int iovcnt, char *buf, u_char proto);
 
 
 /* 
@@ -73,84 +147,43 @@ void build_and_send_UDP(UDP_packet *packet, size_t size);
  *   tshark -T fields -e frame.time_epoch -e frame.cap_len -e frame.len -e eth.dst -e eth.src -e eth.type  -r ping.dmp
  */
 
-int main(int argc, char *argv[])
+void open_capture(Interface *ifc)
 {
-	struct pcap_file_header pfh;
-	char *filename;
-
-	/* start with something like this (or use this if you like it) */
-	/* i'm using it */
-	if (argc == 2 && !(strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) ) {
-		filename = argv[1];
-	} else if ((argc == 3) && (strcmp(argv[1],"-d") == 0)) {
-		debug = 1;
-		twig_debug = 1;
-		filename = argv[2];
-	}
-	else if ((argc == 3) && (strcmp(argv[1],"-n") == 0)) {
-		filename = argv[2];
-	} 
-    else if ((argc == 3) && (strcmp(argv[1],"-td") == 0)) {
-        twig_debug = 1;
-		filename = argv[2];
-	}
-	else if ((argc == 3) && (strcmp(argv[1],"-a") == 0)) {
-		arp_debug = 1;
-		filename = argv[2];
- 	}
-	else if ((argc == 3) && (strcmp(argv[1],"-i") == 0)) {
-		std::string ip_addr = argv[2];
-		
-		// Find the mask if the string is in the right pos
-		std::string mask = ip_addr.find("_") ? ip_addr.substr(ip_addr.find("_") + 1) : "";
-
-		ip_addr = ip_addr.substr(0, ip_addr.find("_"));
-		ip_addr.at(ip_addr.length() - 1) = '0'; // Set the last octet to 0
-
-		// Hardcoded for this assignment
-
-		std::string temp_filename = ip_addr + "_" + mask + ".dmp";
-		filename = strdup(temp_filename.c_str());
-
-		printf("Network address: %s/%s\n", ip_addr.c_str(), mask.c_str());
-		printf("Filename: %s\n", filename);
-	} else {
-		fprintf(stdout,"Usage for normal: %s filename\n", argv[0]);
-		fprintf(stdout,"Usage for interface: %s -i [interface]\n", argv[0]);
-		fprintf(stdout,"Usage for debug types where -d is for full debug and -dt is for twig debug: %s [-d,-td] filename\n", argv[0]);
-		fprintf(stdout,"Usage for ARP cache output: %s -a filename\n", argv[0]);
+	struct pcap_file_header &pfh = ifc->pfh;
+	const char *filename = ifc->filename;
 
-		exit(99); // a little extreme but i'll allow it
-	}
-
-	if (debug) printf("Trying to read from file '%s'\n", filename);
+	tlog<LOG_TRACE>("Trying to read from file '%s'\n", filename);
 
 	/* now open the file (or if the filename is "-" make it read from standard input)*/
 	if(strcmp(filename, "-") != 0) {
 		// fd = open(filename, O_RDWR);
-		fd = open(filename, O_RDWR | O_APPEND);
-		if(debug) printf("fd: %d\n", fd);
-		if (fd < 0) {
-			if(debug) printf("fd: %d < 0\n", fd);
+		// Writing through an O_APPEND fd moves its offset to the end of the file, which made us
+		// skip anything that arrived while we were replying, so read and write through separate fds.
+		// That means reading our own replies back, so note where they go and skip them (see Own_Writes)
+		ifc->fd = open(filename, O_RDONLY);
+		ifc->out_fd = open(filename, O_WRONLY | O_APPEND);
+		tlog<LOG_TRACE>("fd: %d out_fd: %d\n", ifc->fd, ifc->out_fd);
+		if (ifc->fd < 0 || ifc->out_fd < 0) {
 			fprintf(stderr, "%s: Permission denied\n", filename); // Doesn't hit on Windows but does on Linux
 			exit(1);
 		}
-	} 
-
+		ifc->own = new Own_Writes();
+	} else {
+		ifc->fd = 0;
+		ifc->out_fd = 0;
+	}
 
 	/* read the pcap_file_header at the beginning of the file, check it, then print as requested */
 	int ret = 0;
-	ret = read(fd, &pfh, sizeof(pfh));
+	ret = read(ifc->fd, &pfh, sizeof(pfh));
 	if(ret != sizeof(pfh)) {
-		fprintf(stderr, "truncated pcap header: only %d bytes\n", ret);
+		fprintf(stderr, "%s: truncated pcap header: only %d bytes\n", filename, ret);
 		exit(1);
 	}
 	if (pfh.magic != PCAP_MAGIC) 
 	{
 		if(byteswap32(pfh.magic) == PCAP_MAGIC)
 		{
-			if(debug)
-				printf("byte order reversed\n");
 			pfh.magic = byteswap32(pfh.magic);
 			pfh.version_major = byteswap16(pfh.version_major);
 			pfh.version_minor = byteswap16(pfh.version_minor);
@@ -160,438 +193,708 @@ int main(int argc, char *argv[])
 			pfh.thiszone = byteswap32(pfh.thiszone);
 			pfh.sigfigs = byteswap32(pfh.sigfigs);
 			pfh.snaplen = byteswap32(pfh.snaplen);
-			byteswap = true;
+			ifc->byteswap = true;
 
-			if(debug || twig_debug)
-				printf("byte order reversed\n");
+			tlog<LOG_INFO>("%s: byte order reversed\n", filename);
 			
 		}
 		else
 		{
-			fprintf(stderr, "invalid magic number: 0x%08x\n", pfh.magic);
+			fprintf(stderr, "%s: invalid magic number: 0x%08x\n", filename, pfh.magic);
 			exit(1);
 		}
 	}
 
 	if(pfh.version_major != PCAP_VERSION_MAJOR || pfh.version_minor != PCAP_VERSION_MINOR)
 	{
-		fprintf(stderr, "invalid pcap version: %d.%d\n", pfh.version_major, pfh.version_minor);
+		fprintf(stderr, "%s: invalid pcap version: %d.%d\n", filename, pfh.version_major, pfh.version_minor);
 		exit(1);
 	}
 
 
-    if(debug) {
-        printf("header magic: %08x\n", pfh.magic);
-        printf("header version: %d %d\n", pfh.version_major, pfh.version_minor);
-        printf("header linktype: %d\n\n", pfh.linktype);
-    }
+    tlog<LOG_TRACE>("header magic: %08x\nheader version: %d %d\nheader linktype: %d\n\n",
+        pfh.magic, pfh.version_major, pfh.version_minor, pfh.linktype);
+}
 
-	
-	/* create the ARP cache struct */
-	ARP_Cache *arp_cache;
-	arp_cache = (ARP_Cache *)malloc(sizeof(ARP_Cache)); // Allocate memory for the ARP cache
-	if(arp_cache == NULL) {
-		perror("malloc failed for ARP_Cache");
-		exit(1);
+static char *read_record(Interface *ifc, struct pcap_pkthdr *pph)
+{
+	// The next complete record from this interface's file, or NULL when we've caught up with it
+	// (a record that's only partly written yet is left for next time)
+	char *record;
+
+	if (ifc->use_mmap) {
+		while (true) {
+			record = ifc->pmap.next(pph);
+			if (record == NULL) {
+				// Queued replies can point into the mapping, so get them out before it moves
+				ifc->replies.flush(FLUSH_IDLE);
+				if (!ifc->pmap.refresh())
+					return NULL;
+				continue;
+			}
+			if (pph->caplen <= ifc->pool.snaplen)
+				return record;
+			ifc->counters.oversize_drops++; // a reply to it wouldn't fit a buffer
+			metric_add(metrics().drops[DROP_OVERSIZE]);
+		}
+	}
+
+	uint64_t skipped = ifc->stream.oversize;
+	record = ifc->stream.next(pph, ifc->record_buffer);
+	if (ifc->stream.oversize != skipped) {
+		ifc->counters.oversize_drops += ifc->stream.oversize - skipped;
+		metric_add(metrics().drops[DROP_OVERSIZE], ifc->stream.oversize - skipped);
 	}
-	arp_cache->count = 0; // Initialize the count to 0
+	return record;
+}
+
+char *next_record(Interface *ifc, struct pcap_pkthdr *pph)
+{
+	// Same, minus the replies we appended ourselves
+	while (true) {
+		char *record = read_record(ifc, pph);
+		if (record == NULL || ifc->own == NULL)
+			return record;
+
+		uint64_t end = ifc->read_offset();
+		Own_Record whose;
+		while ((whose = ifc->own->classify(end - sizeof(*pph) - pph->caplen, end)) == OWN_WRITING) {
+			if (ifc->handing_off)
+				sched_yield(); // another thread's write, it notes the range as soon as it's back
+			else
+				ifc->replies.flush(FLUSH_IDLE); // our own -u write, reaping it notes the range
+		}
+		if (whose == OWN_NOT)
+			return record;
+		ifc->counters.own_replies++;
+	}
+}
+
+void handle_record(Interface *ifc, char *record, struct pcap_pkthdr &pph)
+{
+	/* each record is a pcap_pkthdr followed by the packet, laid out like ICMP_packet/UDP_packet */
+	ifc->counters.records++;
+	ifc->counters.bytes += pph.caplen;
+	uint64_t started = lat_now();
+	Lat_Stage kind = LAT_HANDLE_OTHER;
+	Metrics &m = metrics();
+	log_next_packet(); // -L: is this one of the packets that gets logged
+
+	char *packet_buffer = record + sizeof(pph);
+
+    tlog_hex<LOG_TRACE>("Record header", record, sizeof(pph)); // as it sits in the file
+    tlog<LOG_TRACE>("%10u.%06u000\t%u\t%u\t", pph.ts_secs, pph.ts_usecs, pph.caplen, pph.len); // i hate cout
 	
-	if(debug || twig_debug) printf("Created ARP cache struct\n");
-	/* now read each packet in the file */
-	while (1) {
-		char packet_buffer[100000]; // bad boo go away unsafe booos
-		
-		/* read the pcap_packet_header, then print as requested */
-		struct pcap_pkthdr pph;
-		ret = read(fd, &pph, sizeof(pph));
-		
-		if(debug) 
+
+	if (ifc->pfh.linktype == 1 && pph.caplen < sizeof(eth_hdr)) {
+		// Not even a whole Ethernet header
+		metric_add(m.eth_packets[MET_ETH_OTHER]);
+		metric_add(m.eth_bytes[MET_ETH_OTHER], pph.caplen);
+		metric_add(m.drops[DROP_UNHANDLED]);
+	} else if (ifc->pfh.linktype == 1) {
+		eth_hdr *eh = (eth_hdr *) packet_buffer;
+        print_ethernet<LOG_TRACE>(eh);
+
+		switch (byteswap16(eh->type))
 		{
-			printf("Packet header read %d bytes\n", ret);
-			printf("Read: ");
-			for (int i = 0; i < ret; i++) {
-				printf("%02d ", ((unsigned char *)&pph)[i]);
+		case 0x0800: // IPv4
+        {
+            IPv4 *ip_head = (IPv4 *)(packet_buffer + sizeof(eth_hdr));
+			metric_add(m.eth_packets[MET_ETH_IPV4]);
+			metric_add(m.eth_bytes[MET_ETH_IPV4], pph.caplen);
+			if (pph.caplen < sizeof(eth_hdr) + sizeof(IPv4)) {
+				// A truncated frame: the IP header would be past the end of the record (and maybe
+				// the -m mapping or the read buffer), so don't learn from it or look any further
+				metric_add(m.drops[DROP_UNHANDLED]);
+				break;
+			}
+			metric_add(m.ip_packets[ip_head->type]);
+			metric_add(m.ip_bytes[ip_head->type], pph.caplen);
+			print_IPv4<LOG_TRACE>(ip_head); // Packet buffer is the start of the packet, so add eth_hdr size to get to the start of the IPv4 header
+
+			
+			// Add the source MAC and IP to the ARP cache
+			tlog<LOG_TRACE>("Attempting to add to ARP cache\n");
+			uint64_t learned = ifc->arp->inserts;
+			{
+				Lat_Scope timed(LAT_ARP_LEARN);
+				ifc->arp->add_entry(eh->src, ip_head->src);
+			}
+
+			// -a used to print the whole cache for every packet; now it's each host as it's
+			// learned, and the whole cache once at exit
+			if (ifc->arp->inserts != learned)
+				tlog_if<LOG_INFO>(arp_debug, "%s: learned %u.%u.%u.%u at %02x:%02x:%02x:%02x:%02x:%02x\n", ifc->name.c_str(),
+					ip_head->src[0], ip_head->src[1], ip_head->src[2], ip_head->src[3],
+					eh->src[0], eh->src[1], eh->src[2], eh->src[3], eh->src[4], eh->src[5]);
+			
+            if(ip_head->type == 1 && pph.caplen >= sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP)) 
+            {
+				ifc->counters.icmp_packets++;
+				kind = LAT_HANDLE_ICMP;
+				ICMP *icmp = (ICMP *)(packet_buffer + sizeof(eth_hdr) + sizeof(IPv4));
+				size_t size = ip_payload_size(ip_head, pph.caplen - sizeof(eth_hdr), sizeof(ICMP));
+				
+				// The record already is an ICMP_packet, so just look at it where it sits
+				// (the phead in it is still in file byte order)
+				ICMP_packet *packet = (ICMP_packet *)record;
+
+                tlog<LOG_DEBUG>("### We got ourselves an ICMP header ###\n");
+				print_ethernet<LOG_DEBUG>(eh);
+				print_IPv4<LOG_DEBUG>(ip_head);
+				print_ICMP<LOG_DEBUG>(icmp);
+				tlog_hex<LOG_DEBUG>("Payload", packet->payload, size);
+				tlog<LOG_DEBUG>(" Of size: %zu\n", size);
+                do_ICMP(ifc, packet, size);
+            }
+			else if (ip_head->type == 0x11 && pph.caplen >= sizeof(eth_hdr) + sizeof(IPv4) + sizeof(UDP)) // UDP
+			{
+				ifc->counters.udp_packets++;
+				kind = LAT_HANDLE_UDP;
+				UDP *udp = (UDP *)(packet_buffer + sizeof(eth_hdr) + sizeof(IPv4));
+				size_t size = ip_payload_size(ip_head, pph.caplen - sizeof(eth_hdr), sizeof(UDP));
+				count_udp_port(byteswap16(udp->dport), pph.caplen);
+				
+				// Same as ICMP, the record is the view
+				UDP_packet *packet = (UDP_packet *)record;
+
+				tlog<LOG_DEBUG>("### We got ourselves a UDP header ###\n");
+				print_ethernet<LOG_DEBUG>(eh);
+				print_IPv4<LOG_DEBUG>(ip_head);
+				print_UDP<LOG_DEBUG>(udp);
+				tlog_hex<LOG_DEBUG>("Payload", packet->payload, size);
+				tlog<LOG_DEBUG>(" Of size: %zu\n", size);
+				do_UDP(ifc, packet, size);
 			}
-			printf("\n");
-			fflush(stdout);
+			else
+				metric_add(m.drops[DROP_UNHANDLED]);
+			break;
+        }
+		case 0x0806: // ARP
+			ifc->counters.arp_packets++;
+			kind = LAT_HANDLE_ARP;
+			metric_add(m.eth_packets[MET_ETH_ARP]);
+			metric_add(m.eth_bytes[MET_ETH_ARP], pph.caplen);
+			if (pph.caplen >= sizeof(eth_hdr) + sizeof(ARP))
+				print_Arp<LOG_TRACE>((ARP *)(packet_buffer + sizeof(eth_hdr))); // Packet buffer is the start of the packet, so add eth_hdr size to get to the start of the ARP header
+			break;
+		case 0x86DD: // IPv6, counted but not answered
+			metric_add(m.eth_packets[MET_ETH_IPV6]);
+			metric_add(m.eth_bytes[MET_ETH_IPV6], pph.caplen);
+			metric_add(m.drops[DROP_UNHANDLED]);
+			break;
+		default:
+			metric_add(m.eth_packets[MET_ETH_OTHER]);
+			metric_add(m.eth_bytes[MET_ETH_OTHER], pph.caplen);
+			metric_add(m.drops[DROP_UNHANDLED]);
+			break;
 		}
-		
-		if (ret == 0) {
-			usleep(3000); // Delay
-			continue;
+	}
+	lat_record(kind, lat_now() - started);
+}
+
+void open_replay_output(Interface *ifc, const char *out)
+{
+	// Replies go to their own capture instead of the end of the one we read, in the same byte order
+	if (ifc->out_fd > 0 && ifc->out_fd != ifc->fd)
+		close(ifc->out_fd);
+	delete ifc->own; // so they never come back to the reader
+	ifc->own = NULL;
+	ifc->out_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ifc->out_fd < 0) {
+		perror(out);
+		exit(1);
+	}
+
+	pcap_file_header pfh = ifc->pfh;
+	if (ifc->byteswap) {
+		pfh.magic = byteswap32(pfh.magic);
+		pfh.version_major = byteswap16(pfh.version_major);
+		pfh.version_minor = byteswap16(pfh.version_minor);
+		pfh.thiszone = byteswap32(pfh.thiszone);
+		pfh.sigfigs = byteswap32(pfh.sigfigs);
+		pfh.snaplen = byteswap32(pfh.snaplen);
+		pfh.linktype = byteswap32(pfh.linktype);
+	}
+	if (write(ifc->out_fd, &pfh, sizeof(pfh)) != sizeof(pfh)) {
+		perror(out);
+		exit(1);
+	}
+}
+
+void print_replay(FILE *out, const Interface *ifc, uint64_t elapsed_ns)
+{
+	const Iface_Counters &c = ifc->counters;
+	double secs = elapsed_ns / 1e9;
+	uint64_t other = c.records - c.icmp_packets - c.udp_packets - c.arp_packets;
+
+	fprintf(out, "### replay ###\n");
+	fprintf(out, "%-20s %.3f s\n", "elapsed", secs);
+	fprintf(out, "%-20s %" PRIu64 " (%.0f pps)\n", "packets", c.records, secs > 0 ? c.records / secs : 0.0);
+	fprintf(out, "%-20s %" PRIu64 " (%.1f MB/s)\n", "bytes", c.bytes, secs > 0 ? c.bytes / secs / 1e6 : 0.0);
+	fprintf(out, "%-20s %" PRIu64 " (%.1f%%), %" PRIu64 " replies\n", "icmp", c.icmp_packets,
+		c.records ? 100.0 * c.icmp_packets / c.records : 0.0, c.icmp_replies);
+	fprintf(out, "%-20s %" PRIu64 " (%.1f%%), %" PRIu64 " replies, %" PRIu64 " unknown port\n", "udp", c.udp_packets,
+		c.records ? 100.0 * c.udp_packets / c.records : 0.0, c.udp_replies, c.udp_unknown);
+	fprintf(out, "%-20s %" PRIu64 " (%.1f%%)\n", "arp", c.arp_packets, c.records ? 100.0 * c.arp_packets / c.records : 0.0);
+	fprintf(out, "%-20s %" PRIu64 " (%.1f%%)\n", "other", other, c.records ? 100.0 * other / c.records : 0.0);
+	fflush(out);
+}
+
+void send_reply(Interface *ifc, const pcap_pkthdr &pph, const iovec *frame, int iovcnt, char *buf, u_char proto)
+{
+	// buf is what the frame iovecs point into, it can't be reused until the reply is written
+	if (pipelined) {
+		pipeline.queue_reply(ifc, pph, frame, iovcnt, buf, proto);
+		return;
+	}
+	ifc->replies.add(pph, frame, iovcnt, proto);
+	ifc->replies.hold(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<Interface *> interfaces;
+	bool have_filename = false;
+
+	/* start with something like this (or use this if you like it) */
+	/* i'm using it */
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			print_usage(argv[0]);
+		} else if (strcmp(argv[i],"-d") == 0) {
+			log_level = LOG_TRACE;
 		}
-		
-		if(ret != sizeof(pph)) {
-			fprintf(stderr, "truncated packet header: only %d bytes\n", ret);
-			break;
+		else if (strcmp(argv[i],"-n") == 0) {
+			// normal mode, nothing to set
+		} 
+		else if (strcmp(argv[i],"-td") == 0) {
+			if (log_level < LOG_DEBUG)
+				log_level = LOG_DEBUG;
 		}
-		
-		if (byteswap) { // this took me too long to figure this out
-			pph.ts_secs = byteswap32(pph.ts_secs);
-			pph.ts_usecs = byteswap32(pph.ts_usecs);
-			pph.caplen = byteswap32(pph.caplen);
-			pph.len = byteswap32(pph.len);
+		else if ((strcmp(argv[i],"-L") == 0) && (i + 1 < argc)) {
+			log_every = atoi(argv[++i]);
+			if (log_every < 1)
+				print_usage(argv[0]);
 		}
-		
-		/* then read the packet data that goes with it into a buffer (variable size) */
-		// pph.caplen = byteswap32(pph.caplen);
-
-		fflush(stdout);
-		ret = read(fd, packet_buffer, pph.caplen);
-		
-		if(debug) 
-		{
-			printf("Packet read %d bytes\n", ret);
-			fflush(stdout);
-			printf("Read: ");
-			for (int i = 0; i < ret; i++) {
-				printf("%02d ", ((unsigned char *)&pph)[i]);
-			}
-			printf("\n");
+		else if (strcmp(argv[i],"-a") == 0) {
+			arp_debug = 1;
+		}
+		else if (strcmp(argv[i],"-m") == 0) {
+			use_mmap = 1;
+		}
+		else if (strcmp(argv[i],"-u") == 0) {
+			use_uring = 1;
+		}
+		else if (strcmp(argv[i],"-t") == 0) {
+			start_at_tail = 1;
+		}
+		else if (strcmp(argv[i],"-c") == 0) {
+			use_checkpoint = 1;
+		}
+		else if (strcmp(argv[i],"-p") == 0) {
+			pipelined = 1;
+		}
+		else if (strcmp(argv[i],"-P") == 0) {
+			precise_timestamps = true;
+		}
+		else if ((strcmp(argv[i],"-w") == 0) && (i + 1 < argc)) {
+			workers = atoi(argv[++i]);
+			if (workers < 1 || workers > SHARD_MAX_WORKERS)
+				print_usage(argv[0]);
+		}
+		else if ((strcmp(argv[i],"-r") == 0) && (i + 1 < argc)) {
+			replay_file = argv[++i];
 		}
-		
-		if (ret < static_cast<int>(pph.caplen)) {
-			fprintf(stderr, "truncated packet: only %d bytes\n", ret);
+		else if ((strcmp(argv[i],"-S") == 0) && (i + 1 < argc)) {
+			stats_file = argv[++i];
+		}
+		else if ((strcmp(argv[i],"-b") == 0) && (i + 1 < argc)) {
+			batch_deadline_us = atol(argv[++i]);
+			if (batch_deadline_us < 0)
+				print_usage(argv[0]);
+		}
+		else if ((strcmp(argv[i],"-i") == 0) && (i + 1 < argc)) {
+			// Can be given more than once, every interface is served from the same loop
+			std::string ip_addr = argv[++i];
+			
+			// Find the mask if the string is in the right pos
+			std::string mask = ip_addr.find("_") ? ip_addr.substr(ip_addr.find("_") + 1) : "";
+
+			ip_addr = ip_addr.substr(0, ip_addr.find("_"));
+			ip_addr.at(ip_addr.length() - 1) = '0'; // Set the last octet to 0
+
+			// Hardcoded for this assignment
+
+			std::string temp_filename = ip_addr + "_" + mask + ".dmp";
+			char *filename = strdup(temp_filename.c_str());
+
+			printf("Network address: %s/%s\n", ip_addr.c_str(), mask.c_str());
+			printf("Filename: %s\n", filename);
+			interfaces.push_back(new Interface(ip_addr + "/" + mask, filename));
+		}
+		else if (!have_filename && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)) {
+			interfaces.push_back(new Interface(argv[i], argv[i]));
+			have_filename = true;
+		} else {
+			print_usage(argv[0]);
+		}
+	}
+	if (interfaces.empty())
+		print_usage(argv[0]);
+	if (replay_file && interfaces.size() > 1) {
+		fprintf(stderr, "-r replays one capture file\n");
+		exit(1);
+	}
+	if (replay_file && (start_at_tail || use_checkpoint)) {
+		fprintf(stderr, "-r replays the whole capture, ignoring -t and -c\n");
+		start_at_tail = use_checkpoint = 0;
+	}
+
+	for (size_t n = 0; n < interfaces.size(); n++) {
+		if (strcmp(interfaces[n]->filename, "-") == 0 && interfaces.size() > 1) {
+			fprintf(stderr, "standard input can't be mixed with other interfaces\n");
 			exit(1);
 		}
+		for (size_t m = 0; m < n; m++) {
+			if (strcmp(interfaces[n]->filename, interfaces[m]->filename) == 0) {
+				fprintf(stderr, "%s: given more than once\n", interfaces[n]->filename);
+				exit(1);
+			}
+		}
+	}
 
-        if(debug) {
-            printf("%10d", pph.ts_secs); // i hate cout
-            printf(".%06d000\t", pph.ts_usecs);
-            printf("%d\t%d\t", pph.caplen, pph.len);
-        }
-		
+	// Debug output (-d, -td, -a) is formatted on its own thread, see twig-log.h
+	log_start(log_level > LOG_OFF || arp_debug);
+
+	// New UDP services go here; anything else that shows up is dropped (and counted)
+	udp_services.add(UDP_PORT_ECHO, &udp_echo_service);
+	udp_services.add(UDP_PORT_TIME, &udp_time_service);
+	if (log_on<LOG_TRACE>()) udp_services.print(stdout); // before the log thread has anything to say
+	metrics_start(stats_file);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_shutdown; // no SA_RESTART so epoll_wait wakes up for it
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = handle_dump;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	// One waiter for every file, so all the interfaces share a single wakeup
+	Tail_Waiter waiter;
+	waiter.init();
+
+	loop_clock.refresh();
+	timers.start(loop_clock.mono_ns);
+
+	if (workers && pipelined) {
+		fprintf(stderr, "-w already runs the packets on their own threads, ignoring -p\n");
+		pipelined = 0;
+	}
+	bool handoff = pipelined || workers; // the reader passes every record on to another thread
 
-		if (pfh.linktype == 1) {
-			eth_hdr *eh = (eth_hdr *) packet_buffer;
-            if(debug) print_ethernet(eh);
-			if(debug) 
-				printf("ethernet type: 0x%04x\n", byteswap16(eh->type));
+	if (handoff && use_mmap) {
+		// Handing records to other threads doesn't mix with a mapping that moves whenever the file grows
+		fprintf(stderr, "%s reads with read(), ignoring -m\n", pipelined ? "-p" : "-w");
+		use_mmap = 0;
+	}
 
-			switch (byteswap16(eh->type))
-			{
-			case 0x0800: // IPv4
-            {
-                IPv4 *ip_head = (IPv4 *)(packet_buffer + sizeof(eth_hdr));
-				if(debug) print_IPv4(ip_head); // Packet buffer is the start of the packet, so add eth_hdr size to get to the start of the IPv4 header
+	if (use_uring && !uring_available()) {
+		fprintf(stderr, "io_uring unavailable, using read() and writev()\n");
+		use_uring = 0;
+	}
 
-				
-				// Add the source MAC and IP to the ARP cache
-				if(debug || twig_debug || arp_debug) printf("Attempting to add to ARP cache\n");
-				arp_cache->add_entry(eh->src, ip_head->src);
-
-				if(arp_debug) {
-					printf("ARP Cache:\n");
-					for(int i = 0; i < arp_cache->count; i++) {
-						printf("\tMAC: %02x:%02x:%02x:%02x:%02x:%02x\tIP: %d.%d.%d.%d\n", 
-							arp_cache->entries[i].mac[0], arp_cache->entries[i].mac[1], arp_cache->entries[i].mac[2], 
-							arp_cache->entries[i].mac[3], arp_cache->entries[i].mac[4], arp_cache->entries[i].mac[5],
-							arp_cache->entries[i].ip[0], arp_cache->entries[i].ip[1], arp_cache->entries[i].ip[2], 
-							arp_cache->entries[i].ip[3]);
-						printf("\tLast seen: %s", ctime(&arp_cache->entries[i].last_seen));
-					}
+	for (size_t n = 0; n < interfaces.size(); n++) {
+		Interface *ifc = interfaces[n];
+		ifc->index = n;
+		open_capture(ifc);
+		checkpoint_resume(ifc, start_at_tail, use_checkpoint);
+		if (replay_file) {
+			open_replay_output(ifc, replay_file);
+		} else if (strcmp(ifc->filename, "-") == 0 || !waiter.add(ifc->filename)) {
+			tlog<LOG_INFO>("%s: inotify unavailable, polling every %d ms\n", ifc->filename, POLL_TIMEOUT_MS);
+		}
+
+		/* set up the ARP cache struct, reader, buffers and reply batch */
+		if (!ifc->start(use_mmap, use_uring, batch_deadline_us, &timers))
+			fprintf(stderr, "%s: can't be memory-mapped, falling back to read()\n", ifc->filename);
+		tlog<LOG_INFO>("Created ARP cache struct for %s\n", ifc->name.c_str());
+		tlog<LOG_INFO>("Packet buffers: %zu bytes (snaplen %zu)\n", ifc->pool.buf_size, ifc->pool.snaplen);
+	}
+	tlog<LOG_INFO>("Checksum kernel: %s\n", checksum_kernel_name());
+
+	if (pipelined)
+		pipeline.start(&interfaces, handle_record, tick_clock);
+	if (workers)
+		shards.start(&interfaces, workers, handle_record, batch_deadline_us);
+
+	/* now read each packet in the files */
+	uint64_t started_ns = loop_clock.mono_ns;
+	int status = 0;
+	int records_since_tick = 0;
+	bool just_woke = false;
+	size_t live = interfaces.size();
+
+	while (keep_running && live > 0) {
+		int got = 0;
+		live = 0;
+
+		if (dump_latency) {
+			dump_latency = 0;
+			print_histograms(stderr);
+		}
+
+		// Take a burst from each file in turn so one busy segment can't starve the others
+		for (size_t n = 0; n < interfaces.size(); n++) {
+			Interface *ifc = interfaces[n];
+			if (!ifc->open)
+				continue;
+
+			for (int burst = 0; burst < IFACE_BURST && keep_running; burst++) {
+				if (handoff) {
+					// Each record is handed off, so it needs its own buffer
+					if (pipelined)
+						pipeline.recycle();
+					else
+						shards.recycle();
+					if (ifc->record_buffer == NULL)
+						ifc->record_buffer = ifc->pool.get();
 				}
-				
-                if(ip_head->type == 1) 
-                {
-					ICMP *icmp = (ICMP *)(packet_buffer + sizeof(eth_hdr) + sizeof(IPv4));
-					char* payload = packet_buffer + (sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP));
-					size_t size = (pph.caplen - sizeof(eth_hdr) - sizeof(IPv4) - sizeof(ICMP));
-					
-					ICMP_packet *packet;
-					packet = (ICMP_packet *)malloc(sizeof(ICMP_packet)); // Allocate memory for the ICMP packet
-					if(packet == NULL) {
-						perror("malloc failed for ICMP_packet");
-						exit(1);
-					}
-					memcpy(&packet->phead, &pph, sizeof(pph));
-					memcpy(&packet->ehead, eh, sizeof(eth_hdr));
-					memcpy(&packet->ip, ip_head, sizeof(IPv4));
-					memcpy(&packet->icmp, icmp, sizeof(ICMP));
-					memcpy(packet->payload, payload, size);
-
-                    if(twig_debug)
-					{
-						printf("### We got ourselves an ICMP header ###\n");
-						print_ethernet(eh);
-						print_IPv4(ip_head);
-						print_ICMP(icmp);
-						printf("Payload: ");
-						// Print the payload for debugging
-						for (size_t i = 0; i < size; i++) {
-							printf("%02x ", packet->payload[i]);
-						}
-						printf("\n Of size: %zu\n", size);
-					}
-                    do_ICMP(packet, size);
-                }
-				else if (ip_head->type == 0x11) // UDP
-				{
-					UDP *udp = (UDP *)(packet_buffer + sizeof(eth_hdr) + sizeof(IPv4));
-					char* payload = packet_buffer + (sizeof(eth_hdr) + sizeof(IPv4) + sizeof(UDP));
-					size_t size = (pph.caplen - sizeof(eth_hdr) - sizeof(IPv4) - sizeof(UDP));
-					
-					UDP_packet *packet;
-					packet = (UDP_packet *)malloc(sizeof(UDP_packet)); // Allocate memory for the ICMP packet
-					if(packet == NULL) {
-						perror("malloc failed for UDP_packet");
-						exit(1);
-					}
-					memcpy(&packet->phead, &pph, sizeof(pph));
-					memcpy(&packet->ehead, eh, sizeof(eth_hdr));
-					memcpy(&packet->ip, ip_head, sizeof(IPv4));
-					memcpy(&packet->udp, udp, sizeof(UDP));
-					memcpy(packet->payload, payload, size);
-
-					if(twig_debug)
-					{
-						printf("### We got ourselves a UDP header ###\n");
-						print_ethernet(eh);
-						print_IPv4(ip_head);
-						print_UDP(udp);
-						printf("Payload: ");
-						// Print the payload for debugging
-						for (size_t i = 0; i < size; i++) {
-							printf("%02x ", packet->payload[i]);
+
+				struct pcap_pkthdr pph;
+				uint64_t read_start = lat_now();
+				char *record = next_record(ifc, &pph);
+				if (record == NULL) {
+					if (!handoff)
+						ifc->replies.flush(FLUSH_IDLE);
+					if (replay_file) {
+						// It isn't going to grow, that's everything, and a partial record won't ever be finished
+						size_t left = !ifc->use_mmap ? ifc->stream.pending() : ifc->pmap.mapped > ifc->pmap.offset ? ifc->pmap.mapped - ifc->pmap.offset : 0;
+						if (left) {
+							fprintf(stderr, "%s: truncated packet: %zu bytes left over\n", ifc->name.c_str(), left);
+							status = 1;
 						}
-						printf("\n Of size: %zu\n", size);
+						ifc->open = false;
 					}
-					do_UDP(packet, size);
+					break;
+				}
+				got++;
+				lat_record(LAT_READ, lat_now() - read_start);
+
+				if (handoff) {
+					ifc->hand_off(record, pph);
+					if (pipelined)
+						pipeline.push_frame(ifc, record, pph);
+					else
+						shards.push_frame(ifc, record, pph);
+					ifc->record_buffer = NULL;
+					continue; // the clock and the timers belong to the thread that handles the packets
+				}
+
+				handle_record(ifc, record, pph);
+
+				// A queued reply was built on top of this buffer, so it's the batch's now (it goes back to
+				// the pool after the flush) and the next record needs a fresh one
+				if (ifc->replies.holding(ifc->record_buffer))
+					ifc->record_buffer = ifc->pool.get();
+
+				// Busy files may never let us sleep, so keep the clock (and the timers) moving anyway
+				if (++records_since_tick >= CLOCK_REFRESH_RECORDS) {
+					records_since_tick = 0;
+					tick_clock();
 				}
-				break;
-            }
-			case 0x0806: // ARP
-				if(debug) print_Arp((ARP *)(packet_buffer + sizeof(eth_hdr))); // Packet buffer is the start of the packet, so add eth_hdr size to get to the start of the ARP header
-				break;
-			default:
-				break;
 			}
+
+			if (!handoff && ifc->replies.replies)
+				ifc->replies.check_deadline();
+			if (ifc->open)
+				live++;
+		}
+		metrics_tick();
+		checkpoint_tick();
+
+		// Our own writes fire IN_MODIFY too; if that's all the wakeup was for, there's no reply to time
+		if (just_woke && got == 0)
+			__atomic_store_n(&last_wake_ns, 0, __ATOMIC_RELAXED);
+		just_woke = false;
+
+		// Every file is caught up (and its replies are out), sleep until one of them grows
+		if (got == 0 && live > 0) {
+			just_woke = wait_for_data(waiter);
+			if (!handoff)
+				tick_clock();
+		}
+	}
+
+	if (pipelined)
+		pipeline.finish();
+	if (workers)
+		shards.finish();
+	waiter.close_all();
+	log_stop(); // everything that logs is done, get the rest out before the stats
+	for (size_t n = 0; n < interfaces.size(); n++)
+		interfaces[n]->stop();
+	checkpoint_save(); // every reply is out and every buffer back, so everything read so far is done with
+	loop_clock.refresh();
+	uint64_t elapsed_ns = loop_clock.mono_ns - started_ns;
+	print_stats(stderr);
+	for (size_t n = 0; n < interfaces.size(); n++) {
+		interfaces[n]->print_stats(stderr);
+		if (arp_debug) {
+			// -w handed the cache over to the table all the workers share, see Shard_Set::start
+			printf("%s: ", interfaces[n]->name.c_str());
+			if (interfaces[n]->arp)
+				interfaces[n]->arp->print(stdout);
+			else if (interfaces[n]->shared_arp)
+				interfaces[n]->shared_arp->print(stdout, loop_clock);
 		}
 	}
+	if (pipelined)
+		pipeline.print_stats(stderr);
+	if (workers)
+		shards.print_stats(stderr);
+	timers.print_stats(stderr);
+	log_print_stats(stderr);
+	metrics_write(); // the final counts, now every thread is done
+	if (TWIG_LATENCY)
+		print_histograms(stderr);
+	if (replay_file)
+		print_replay(stderr, interfaces[0], elapsed_ns);
+	for (size_t n = 0; n < interfaces.size(); n++)
+		delete interfaces[n];
+	return status;
 }
 
 
 /* Function definitions */ 
 
-void print_ethernet(struct eth_hdr *peh) {
+template <int L> void print_ethernet(struct eth_hdr *peh) {
+	if (!log_on<L>())
+		return; // don't even read the headers
 	// Had to swap to printf because cout was breaking the output for some reason
-	printf("%02x:%02x:%02x:%02x:%02x:%02x\t", peh->dest[0], peh->dest[1], peh->dest[2], peh->dest[3], peh->dest[4], peh->dest[5]);
-	printf("%02x:%02x:%02x:%02x:%02x:%02x\t", peh->src[0], peh->src[1], peh->src[2], peh->src[3], peh->src[4], peh->src[5]);
-	printf("0x%04x\n", byteswap16(peh->type));
-	fflush(stdout);
+	// (and now it's one log entry, so nothing gets formatted unless it's wanted)
+	tlog<L>("%02x:%02x:%02x:%02x:%02x:%02x\t%02x:%02x:%02x:%02x:%02x:%02x\t0x%04x\n",
+		peh->dest[0], peh->dest[1], peh->dest[2], peh->dest[3], peh->dest[4], peh->dest[5],
+		peh->src[0], peh->src[1], peh->src[2], peh->src[3], peh->src[4], peh->src[5], byteswap16(peh->type));
 }
 
-void print_UDP(UDP *udp) {
-	printf("\tUDP:\tSport:\t%d\n", byteswap16(udp->sport));
-	printf("\t\tDport:\t%d\n", byteswap16(udp->dport));
-	printf("\t\tDGlen:\t%d\n", byteswap16(udp->len));
-	printf("\t\tCSum:\t%d\n", byteswap16(udp->checksum));
+template <int L> void print_UDP(UDP *udp) {
+	if (!log_on<L>())
+		return; // don't even read the headers
+	tlog<L>("\tUDP:\tSport:\t%d\n\t\tDport:\t%d\n\t\tDGlen:\t%d\n\t\tCSum:\t%d\n",
+		byteswap16(udp->sport), byteswap16(udp->dport), byteswap16(udp->len), byteswap16(udp->checksum));
 }
 
-void print_TCP(TCP *tcp) {
-	printf("\tTCP:\tSport:\t%d\n", byteswap16(tcp->sport));
-	printf("\t\tDport:\t%d\n", byteswap16(tcp->dport));
-
-	printf("\t\tFlags:\t%s", (tcp->flags & 0x01 ? "F" : "-"));
-	printf("%s", (tcp->flags & 0x02 ? "S" : "-"));
-	printf("%s", (tcp->flags & 0x04 ? "R" : "-"));
-	printf("%s", (tcp->flags & 0x08 ? "P" : "-"));
-	printf("%s", (tcp->flags & 0x10 ? "A" : "-"));
-	printf("%s", (tcp->flags & 0x20 ? "U" : "-"));
-	printf("\n");
-
-	printf("\t\tSeq:\t%u\n", byteswap32(tcp->seq));
-	printf("\t\tACK:\t%u\n", byteswap32(tcp->ack));
-	printf("\t\tWin:\t%d\n", byteswap16(tcp->win));
-	printf("\t\tCSum:\t%d\n", byteswap16(tcp->csum));
+template <int L> void print_TCP(TCP *tcp) {
+	if (!log_on<L>())
+		return; // don't even read the headers
+	tlog<L>("\tTCP:\tSport:\t%d\n\t\tDport:\t%d\n", byteswap16(tcp->sport), byteswap16(tcp->dport));
+
+	tlog<L>("\t\tFlags:\t%s%s%s%s%s%s\n",
+		(tcp->flags & 0x01 ? "F" : "-"), (tcp->flags & 0x02 ? "S" : "-"), (tcp->flags & 0x04 ? "R" : "-"),
+		(tcp->flags & 0x08 ? "P" : "-"), (tcp->flags & 0x10 ? "A" : "-"), (tcp->flags & 0x20 ? "U" : "-"));
+
+	tlog<L>("\t\tSeq:\t%u\n\t\tACK:\t%u\n\t\tWin:\t%d\n\t\tCSum:\t%d\n",
+		byteswap32(tcp->seq), byteswap32(tcp->ack), byteswap16(tcp->win), byteswap16(tcp->csum));
 }
 
-void print_IPv4(IPv4 *ipv4) {
-	printf("\tIP:\tVers:\t4\n");
-	printf("\t\tHlen:\t%d bytes\n", (ipv4->hlen & 0x0F) * 4); // this was also gross
-	printf("\t\tSrc:\t%d.%d.%d.%d\t\n", ipv4->src[0], ipv4->src[1], ipv4->src[2], ipv4->src[3]);
-	printf("\t\tDest:\t%d.%d.%d.%d\t\n", ipv4->dest[0], ipv4->dest[1], ipv4->dest[2], ipv4->dest[3]);
-	printf("\t\tTTL:\t%d\n", ipv4->ttl);
-	printf("\t\tFrag Ident:\t%d\n", byteswap16(ipv4->frag_ident));
+template <int L> void print_IPv4(IPv4 *ipv4) {
+	if (!log_on<L>())
+		return; // don't even read the headers
+	tlog<L>("\tIP:\tVers:\t4\n\t\tHlen:\t%d bytes\n", (ipv4->hlen & 0x0F) * 4); // this was also gross
+	tlog<L>("\t\tSrc:\t%d.%d.%d.%d\t\n\t\tDest:\t%d.%d.%d.%d\t\n",
+		ipv4->src[0], ipv4->src[1], ipv4->src[2], ipv4->src[3], ipv4->dest[0], ipv4->dest[1], ipv4->dest[2], ipv4->dest[3]);
+	tlog<L>("\t\tTTL:\t%d\n\t\tFrag Ident:\t%d\n", ipv4->ttl, byteswap16(ipv4->frag_ident));
 	
-	printf("\t\tFrag Offset:\t%d\n", (byteswap16(ipv4->frag_offset) & 0x1FFF) * 8); // this was gross; i had to look up the offset for the offset
+	tlog<L>("\t\tFrag Offset:\t%d\n", (byteswap16(ipv4->frag_offset) & 0x1FFF) * 8); // this was gross; i had to look up the offset for the offset
 
-	printf("\t\tFrag DF:\t%s\n", (byteswap16(ipv4->frag_offset) & 0x4000) ? "yes" : "no"); // i haven't had an excuse to use a ? in a while
-	printf("\t\tFrag MF:\t%s\n", (byteswap16(ipv4->frag_offset) & 0x2000) ? "yes" : "no");
-	printf("\t\tIP CSum:\t%d\n", byteswap16(ipv4->csum));
+	tlog<L>("\t\tFrag DF:\t%s\n", (byteswap16(ipv4->frag_offset) & 0x4000) ? "yes" : "no"); // i haven't had an excuse to use a ? in a while
+	tlog<L>("\t\tFrag MF:\t%s\n\t\tIP CSum:\t%d\n", (byteswap16(ipv4->frag_offset) & 0x2000) ? "yes" : "no", byteswap16(ipv4->csum));
 	if(ipv4->type == 0x06) {
-		printf("\t\tType:\t0x%x\t(TCP)\n", ipv4->type);
-		print_TCP((TCP *)(ipv4 + 1));
+		tlog<L>("\t\tType:\t0x%x\t(TCP)\n", ipv4->type);
+		print_TCP<L>((TCP *)(ipv4 + 1));
 	} else
-		printf("\t\tType:\t0x%x\t\n", ipv4->type);
+		tlog<L>("\t\tType:\t0x%x\t\n", ipv4->type);
 }
 
-void print_Arp(ARP *arp) {
-	printf("\tARP:\tHWtype:\t%d\n", byteswap16(arp->htype));
-	printf("\t\thlen:\t%d\n", arp->hlen);
-	printf("\t\tplen:\t%d\n", arp->plen);
-	printf("\t\tOP:\t%d (ARP %s)\n", byteswap16(arp->op), (byteswap16(arp->op) == 1) ? "request" : "reply");
-	printf("\t\tHardware:\t%02x:%02x:%02x:%02x:%02x:%02x\n", arp->sha[0], arp->sha[1], arp->sha[2], arp->sha[3], arp->sha[4], arp->sha[5]);
-	printf("\t\t\t==>\t%02x:%02x:%02x:%02x:%02x:%02x\n", arp->tha[0], arp->tha[1], arp->tha[2], arp->tha[3], arp->tha[4], arp->tha[5]);
-	printf("\t\tProtocol:\t%d.%d.%d.%d\t\n", arp->spa[0], arp->spa[1], arp->spa[2], arp->spa[3]);
-	printf("\t\t\t==>\t%d.%d.%d.%d\t\n", arp->tpa[0], arp->tpa[1], arp->tpa[2], arp->tpa[3]);
+template <int L> void print_Arp(ARP *arp) {
+	if (!log_on<L>())
+		return; // don't even read the headers
+	tlog<L>("\tARP:\tHWtype:\t%d\n\t\thlen:\t%d\n\t\tplen:\t%d\n", byteswap16(arp->htype), arp->hlen, arp->plen);
+	tlog<L>("\t\tOP:\t%d (ARP %s)\n", byteswap16(arp->op), (byteswap16(arp->op) == 1) ? "request" : "reply");
+	tlog<L>("\t\tHardware:\t%02x:%02x:%02x:%02x:%02x:%02x\n", arp->sha[0], arp->sha[1], arp->sha[2], arp->sha[3], arp->sha[4], arp->sha[5]);
+	tlog<L>("\t\t\t==>\t%02x:%02x:%02x:%02x:%02x:%02x\n", arp->tha[0], arp->tha[1], arp->tha[2], arp->tha[3], arp->tha[4], arp->tha[5]);
+	tlog<L>("\t\tProtocol:\t%d.%d.%d.%d\t\n\t\t\t==>\t%d.%d.%d.%d\t\n",
+		arp->spa[0], arp->spa[1], arp->spa[2], arp->spa[3], arp->tpa[0], arp->tpa[1], arp->tpa[2], arp->tpa[3]);
 }
 
-void print_ICMP(ICMP *icmp){
-    printf("\tICMP:\tType:\t%d\n", icmp->type);
-    printf("\t\tCode:\t%d\n", icmp->code);
-    printf("\t\tCSum:\t%d\n", byteswap16(icmp->checksum));
+template <int L> void print_ICMP(ICMP *icmp){
+    if (!log_on<L>())
+        return;
+    tlog<L>("\tICMP:\tType:\t%d\n\t\tCode:\t%d\n\t\tCSum:\t%d\n", icmp->type, icmp->code, byteswap16(icmp->checksum));
     if (icmp->type == 0 || icmp->type == 8) { // Echo reply or request
-        printf("\t\tID:\t%d\n", byteswap16(icmp->id));
-        printf("\t\tSeq:\t%d\n", byteswap16(icmp->seq));
+        tlog<L>("\t\tID:\t%d\n\t\tSeq:\t%d\n", byteswap16(icmp->id), byteswap16(icmp->seq));
     }
 }
 
-void do_ICMP(ICMP_packet *packet, size_t size){
-	if(twig_debug) printf("Doing ICMP\n");
-	// Build the ICMP packet
-	ICMP_packet *reply;
-	reply = (ICMP_packet *)malloc(sizeof(ICMP_packet)); // Allocate memory for the ICMP packet
-	
-	if(reply == NULL) {
-		perror("malloc failed for ICMP_packet reply");
-		exit(1);
-	}
-	
-	memcpy(&reply->icmp, &packet->icmp, sizeof(ICMP)); // Copy the ICMP header from the original packet
-	memcpy(&reply->phead.ts_secs, &packet->phead.ts_secs, sizeof(packet->phead.ts_secs)); // Copy the timestamp from the original packet
-	memcpy(&reply->phead.ts_usecs, &packet->phead.ts_usecs, sizeof(packet->phead.ts_usecs)); // Copy the timestamp from the original packet
-	
-	
-	if(packet->icmp.type == 8) // We got an echo request (ping), we must reply!!! I've been pinged!!!!!!
-    {
-		
-        reply->icmp.type = 0; // Echo reply->icmp
-		reply->icmp.code = 0; // Code for echo reply->icmp
-		reply->icmp.id = packet->icmp.id; // Copy the ID from the request
-		reply->icmp.seq = packet->icmp.seq; // Copy the sequence number from the request
-		reply->icmp.checksum = 0; // Temporary value, will be calculated later
-		memcpy(reply->payload, packet->payload, size); // Copy the payload from the original packet
-		
-		// Calculate checksum after setting all fields
-#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
-		reply->icmp.checksum = ICMP_checksum_maker((u_short *) &reply->icmp, sizeof(ICMP) + size); // Calculate the checksum for the ICMP header		
-
-		// Copy the ethernet header and IP headers
-		reply->ehead = packet->ehead; // Copy the ethernet header
-		memcpy(reply->ehead.dest, packet->ehead.src, sizeof(reply->ehead.dest)); // Swap source and destination MAC addresses
-		memcpy(reply->ehead.src, packet->ehead.dest, sizeof(reply->ehead.src)); // Swap source and destination MAC addresses
-
-
-		reply->ip = packet->ip; // Copy the IP header
-		memcpy(reply->ip.dest, packet->ip.src, 4); // Swap source and destination IP addresses
-		memcpy(reply->ip.src, packet->ip.dest, 4);
-		reply->ip.len = byteswap16(sizeof(IPv4) + sizeof(ICMP) + size); // Set the length of the IP header
-		reply->ip.frag_ident = byteswap16(0); // Set the fragment identifier to 0
-		reply->ip.frag_offset = byteswap16(0); // Set the fragment offset to 0
-		reply->ip.ttl = 64; // Set the TTL to 64
-		reply->ip.csum = 0; // Temporary value, will be calculated later
-
-
-#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
-		reply->ip.csum = IPv4_checksum_maker((u_short *)&reply->ip, sizeof(IPv4)); // Calculate the checksum for the IP header
-
-    }
+void do_ICMP(Interface *ifc, ICMP_packet *packet, size_t size){
+	tlog<LOG_DEBUG>("Doing ICMP\n");
 
-	if(twig_debug)
+	if(packet->icmp.type != 8)
 	{
-		printf("Attempting to write reply to pcap file\n");
-		printf("ICMP Reply:\n");
-		print_ICMP(&reply->icmp);
-	}
-
-	build_and_send_ICMP(reply, size);
-}
-
-u_short ICMP_checksum_maker(u_short *buffer, int size) {
-	unsigned long sum = 0;
-
-	// Sum up 16-bit words
-	while (size > 1) {
-		sum += *buffer++;
-		size -= 2;
-	}
-
-	// Add any remaining byte
-	if (size == 1) {
-		sum += *(u_char *)buffer;
-	}
-
-	// Fold 32-bit sum to 16 bits
-	while (sum >> 16) {
-		sum =(sum & 0xFFFF) + (sum >> 16);
+		// Only echo requests get answered (this also skips our own replies when we read them back)
+		metric_add(metrics().drops[DROP_NOT_ECHO]);
+		return;
 	}
 
-	return ~sum;
-}
+	// We got an echo request (ping), we must reply!!! I've been pinged!!!!!!
+	// The reply is the request turned around, so rewrite the headers in place and leave the payload where it is
+	ICMP_packet *reply = (ICMP_packet *)reply_headers(ifc, (char *)packet, sizeof(ICMP_packet) - sizeof(packet->payload));
+	const char *payload = packet->payload;
 
-u_short IPv4_checksum_maker(u_short *buffer, int size)
-{
-	unsigned long sum = 0;
+	// Ethernet and IP come from this peer's template. Only type and code change in the ICMP
+	// header, so its checksum is patched from the request's (RFC 1624) rather than re-summed.
+	uint64_t checksum_start = lat_now();
+	uint64_t old_icmp = csum_partial(&reply->icmp, 2, 0); // type and code
 
-	// Sum up 16-bit words
-	while (size > 1) {
-		sum += *buffer++;
-		size -= 2;
-	}
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+	ifc->headers.turn_around((char *)&reply->ehead, sizeof(IPv4) + sizeof(ICMP) + size);
 
-	// Add any remaining byte
-	if (size == 1) {
-		sum += *(u_char *)buffer;
-	}
+	reply->icmp.type = 0; // Echo reply
+	reply->icmp.code = 0; // Code for echo reply (id, seq and payload stay as they are)
+	reply->icmp.checksum = csum_update(reply->icmp.checksum, old_icmp, csum_partial(&reply->icmp, 2, 0));
+	lat_record(LAT_CHECKSUM, lat_now() - checksum_start);
 
-	// Fold 32-bit sum to 16 bits
-	while (sum >> 16) {
-		sum = (sum & 0xFFFF) + (sum >> 16);
-	}
+	tlog<LOG_DEBUG>("Attempting to write reply to pcap file\nICMP Reply:\n");
+	print_ICMP<LOG_DEBUG>(&reply->icmp);
 
-	return ~sum;
+	build_and_send_ICMP(ifc, reply, payload, size);
+	ifc->counters.icmp_replies++;
 }
 
-void build_and_send_ICMP(ICMP_packet *packet, size_t size) {
+void build_and_send_ICMP(Interface *ifc, ICMP_packet *packet, const char *payload, size_t size) {
 	// Time to write to pcap file
 	// pcap_pkthdr phead = packet->phead;
 	ICMP icmp = packet->icmp;
 
 	pcap_pkthdr pph;
 
-	timeval temp_time;
-
-	gettimeofday(&temp_time, NULL); // Get the current time
-	pph.ts_secs = temp_time.tv_sec; // Copy the timestamp from the original packet
-	pph.ts_usecs = temp_time.tv_usec; // Copy the microseconds from the original packet
-	
+	loop_clock.reply_stamp(&pph.ts_secs, &pph.ts_usecs); // the loop's time, unless -P
 
 	pph.caplen = sizeof(eth_hdr) + sizeof(IPv4) + icmp.length() + size; // Dynamically calculate the captured length, including the ICMP payload size
 	pph.len = pph.caplen; // Set the actual length to the captured length
 
-	if(twig_debug){
-		printf("sizeof(pcap_pkthdr): %zu\n", sizeof(pcap_pkthdr));
-		printf("sizeof(eth_hdr): %zu\n", sizeof(eth_hdr));
-		printf("sizeof(IPv4): %zu\n", sizeof(IPv4));
-		printf("sizeof(ICMP): %zu\n", sizeof(ICMP));
-		printf("ICMP type : %d\n", icmp.type);
-	}
+	tlog<LOG_DEBUG>("sizeof(pcap_pkthdr): %zu\nsizeof(eth_hdr): %zu\nsizeof(IPv4): %zu\nsizeof(ICMP): %zu\nICMP type : %d\n",
+		sizeof(pcap_pkthdr), sizeof(eth_hdr), sizeof(IPv4), sizeof(ICMP), icmp.type);
 
-	if(twig_debug || debug)
-	{
-		printf("### Sending ICMP Reply ###\n");
-		print_ethernet(&packet->ehead); // Print the ethernet header for debugging
-		print_IPv4(&packet->ip); // Print the IPv4 header for debugging
-		print_ICMP(&packet->icmp); // Print the ICMP header for debugging
-		printf("Payload: ");
-		// Print the payload for debugging
-		for (size_t i = 0; i < size; i++) {
-			printf("%02x ", packet->payload[i]);
-		}
-		printf("\n Of size: %zu\n", size);
-		printf("Total size of packet: %u, versus predicted: %zu\n", pph.caplen, sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP) + size);
-	}
+	tlog<LOG_DEBUG>("### Sending ICMP Reply ###\n");
+	print_ethernet<LOG_DEBUG>(&packet->ehead); // Print the ethernet header for debugging
+	print_IPv4<LOG_DEBUG>(&packet->ip); // Print the IPv4 header for debugging
+	print_ICMP<LOG_DEBUG>(&packet->icmp); // Print the ICMP header for debugging
+	tlog_hex<LOG_DEBUG>("Payload", payload, size); // copied, it's gone by the time this is printed
+	tlog<LOG_DEBUG>(" Of size: %zu\nTotal size of packet: %u, versus predicted: %zu\n", size, pph.caplen,
+		sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP) + size);
 
 	// Build the packet here
 	iovec out_packet[10];
@@ -604,124 +907,98 @@ void build_and_send_ICMP(ICMP_packet *packet, size_t size) {
 	out_packet[2].iov_len = sizeof(IPv4); // Correctly calculate the size of the IPv4 header
 	out_packet[3].iov_base = &packet->icmp;
 	out_packet[3].iov_len = sizeof(ICMP); // Correctly calculate the size of the ICMP header
-	out_packet[4].iov_base = packet->payload;
+	out_packet[4].iov_base = (void *)payload; // still sitting in the request
 	out_packet[4].iov_len = size; // Correctly calculate the size of the payload
 
-	// Send the out_packet here
-	if(writev(fd, out_packet, 5) == -1) // Correct the number of iovec elements to include ICMP
-	{
-		perror("writev failed");
-		free(packet);
-		exit(1);
+	// Queue the out_packet here, the batch writes it (and whatever else is waiting) in one writev
+	if (ifc->byteswap) { // the record header has to match the rest of the file
+		pph.ts_secs = byteswap32(pph.ts_secs);
+		pph.ts_usecs = byteswap32(pph.ts_usecs);
+		pph.caplen = byteswap32(pph.caplen);
+		pph.len = byteswap32(pph.len);
 	}
+	send_reply(ifc, pph, out_packet + 1, 4, (char *)packet, 1); // the headers (and maybe the payload) live in packet
 
 }
 
-void do_UDP(UDP_packet *packet, size_t size)
+void do_UDP(Interface *ifc, UDP_packet *packet, size_t size)
 {
-	if(twig_debug) printf("Doing UDP\n");
-
-	
-	// Build the UDP packet
-	
-	UDP_packet *reply;
-	reply = (UDP_packet *)malloc(sizeof(ICMP_packet)); // Allocate memory for the ICMP packet
-	if(reply == NULL) {
-		perror("malloc failed for ICMP_packet reply");
-		exit(1);
-	}
-	memcpy(reply->payload, packet->payload, size); // Copy the payload from the original packet so that way it's not a weird size
-	memcpy(&reply->phead.ts_secs, &packet->phead.ts_secs, sizeof(packet->phead.ts_secs)); // Copy the timestamp from the original packet
-	memcpy(&reply->phead.ts_usecs, &packet->phead.ts_usecs, sizeof(packet->phead.ts_usecs)); // Copy the timestamp from the original packet
-	
-	// Copy the ethernet header and IP headers
-	reply->ehead = packet->ehead; // Copy the ethernet header
-	memcpy(reply->ehead.dest, packet->ehead.src, sizeof(reply->ehead.dest)); // Swap source and destination MAC addresses
-	memcpy(reply->ehead.src, packet->ehead.dest, sizeof(reply->ehead.src)); // Swap source and destination MAC addresses
-	
-	reply->ip = packet->ip; // Copy the IP header
-
-	reply->ip.frag_offset = byteswap16(0); // Set the fragment offset to 0
-	reply->ip.ttl = 64; // Set the TTL to 64
-	reply->ip.csum = 0; // Temporary value, will be calculated later
-	reply->ip.len = byteswap16(sizeof(IPv4) + sizeof(UDP) + size); // Set the length of the IP header
-	reply->ip.frag_ident = byteswap16(0); // Set the fragment identifier to 0
-	reply->ip.type = 0x11; // Set the protocol type to UDP
-	memcpy(reply->ip.dest, packet->ip.src, 4); // Swap source and destination IP addresses
-	memcpy(reply->ip.src, packet->ip.dest, 4);
-
-	memcpy(&reply->udp, &packet->udp, sizeof(ICMP)); // Copy the ICMP header from the original packet
-
-	if(byteswap16(packet->udp.dport) == 7) // We got an echo request (ping), we must reply!!! I've been pinged!!!!!!
-    {
-		reply->udp.sport = packet->udp.dport; // Copy the source port from the request
-		reply->udp.dport = packet->udp.sport; // Copy the destination port from the request
-		reply->udp.len = byteswap16(sizeof(UDP) + size); // Set the length of the UDP header
-		reply->udp.checksum = 0; // Temporary value, will be calculated later
-		memcpy(reply->payload, packet->payload, size); // Copy the payload from the original packet
+	tlog<LOG_DEBUG>("Doing UDP\n");
+
+	UDP_Request req;
+	req.packet = packet;
+	req.sport = byteswap16(packet->udp.sport);
+	req.dport = byteswap16(packet->udp.dport);
+	req.payload = packet->payload;
+	req.size = size;
+
+	const UDP_Service *service = udp_services.find(req.dport);
+	if (service == NULL) {
+		tlog<LOG_DEBUG>("No service on UDP port %u, dropping\n", req.dport);
+		ifc->counters.udp_unknown++;
+		metric_add(metrics().drops[DROP_NO_SERVICE]);
+		return;
 	}
-	else if(byteswap16(packet->udp.dport) == 37) // Time request
-	{
-		reply->udp.sport = packet->udp.dport; // Copy the source port from the request
-		reply->udp.dport = packet->udp.sport; // Copy the destination port from the request
-		reply->udp.checksum = 0; // Temporary value, will be calculated later
-		
-		// populate the payload with the current time
-
-		u_int32_t now = std::chrono::duration_cast<std::chrono::seconds> (std::chrono::system_clock::now().time_since_epoch()).count();
-		// Credit code to https://www.epochconverter.com/ ^
-	
-		memcpy(reply->payload, &now, sizeof(u_int32_t)); // Copy the time to the payload
-		size = sizeof(u_int32_t); // Set the size to the size of the time payload
 
-		reply->udp.len = byteswap16(sizeof(UDP) + size); // Set the length of the UDP header
-		reply->ip.len = byteswap16(sizeof(IPv4) + sizeof(UDP) + size); // Set the length of the IP header
-	}
-	else
-	{
-		printf("Uhhh... idk..... hello world? (unknown UDP type)\n");
-		free(reply);
+	// Build the UDP reply on top of the request, just like ICMP
+	UDP_packet *reply = (UDP_packet *)reply_headers(ifc, (char *)packet, sizeof(UDP_packet) - sizeof(packet->payload));
+
+	UDP_Reply out;
+	out.buf = reply->payload;
+	out.room = size > POOL_MIN_SNAPLEN - UDP_HEADERS ? size : POOL_MIN_SNAPLEN - UDP_HEADERS; // every pool buffer has this much
+	out.payload = packet->payload; // echo unless the service says otherwise
+	out.size = size;
+	out.rewritten = false;
+	if (!service->handle(req, &out)) {
+		metric_add(metrics().drops[DROP_SERVICE]);
+		if (ifc->use_mmap)
+			ifc->pool.put((char *)reply); // reply_headers() took it from the pool, and nothing's going to hold it
 		return;
 	}
+	const char *payload = out.payload;
+	size = out.size;
 
-	
-	// Calculate checksum after setting all fields 
-	// THIS IS OPTIONAL SO I AM NOT DOING IT!
-	// #pragma GCC diagnostic ignored "-Waddress-of-packed-member"
-	// reply->udp.checksum = byteswap16(UDP_checksum_maker((u_short *) &reply->udp, sizeof(UDP) + size));
-
-
+	uint64_t checksum_start = lat_now();
+	ifc->headers.turn_around((char *)&reply->ehead, sizeof(IPv4) + sizeof(UDP) + size);
 
-#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
-	reply->ip.csum = IPv4_checksum_maker((u_short *)&reply->ip, sizeof(IPv4)); // Calculate the checksum for the IP header
-
-	build_and_send_UDP(reply, size);
-}
-
-u_short UDP_checksum_maker(u_short *buffer, int size)
-{
-	unsigned long sum = 0;
-
-	// Sum up 16-bit words
-	while (size > 1) {
-		sum += *buffer++;
-		size -= 2;
-	}
+	// Swapping the ports (and the addresses in the pseudo header) doesn't change the sum, so an
+	// echo reply's UDP checksum is just the request's. No checksum (0) stays no checksum.
+	u_short sport = reply->udp.sport;
+	reply->udp.sport = reply->udp.dport; // Swap the ports
+	reply->udp.dport = sport;
 
-	// Add any remaining byte
-	if (size == 1) {
-		sum += *(u_char *)buffer;
-	}
+	reply->udp.len = byteswap16(sizeof(UDP) + size); // Set the length of the UDP header
 
-	// Fold 32-bit sum to 16 bits
-	while (sum >> 16) {
-		sum = (sum & 0xFFFF) + (sum >> 16);
+	if(out.rewritten)
+	{
+		// Brand new payload, services send small ones, so summing it from scratch costs little
+		struct {
+			u_char src[4];
+			u_char dest[4];
+			u_char zero;
+			u_char proto;
+			u_short len;
+		} pseudo;
+		memcpy(pseudo.src, reply->ip.src, 4);
+		memcpy(pseudo.dest, reply->ip.dest, 4);
+		pseudo.zero = 0;
+		pseudo.proto = 0x11;
+		pseudo.len = reply->udp.len;
+
+		reply->udp.checksum = 0;
+		uint64_t sum = csum_partial(&pseudo, sizeof(pseudo), 0);
+		sum = csum_partial(&reply->udp, sizeof(UDP), sum);
+		reply->udp.checksum = csum_fold(csum_partial(payload, size, sum));
+		if (reply->udp.checksum == 0)
+			reply->udp.checksum = 0xFFFF; // 0 means "no checksum" for UDP
 	}
+	lat_record(LAT_CHECKSUM, lat_now() - checksum_start);
 
-	return ~sum;
+	build_and_send_UDP(ifc, reply, payload, size);
+	ifc->counters.udp_replies++;
 }
 
-void build_and_send_UDP(UDP_packet *packet, size_t size)
+void build_and_send_UDP(Interface *ifc, UDP_packet *packet, const char *payload, size_t size)
 {
 	// Time to write to pcap file
 	// pcap_pkthdr phead = packet->phead;
@@ -731,36 +1008,21 @@ void build_and_send_UDP(UDP_packet *packet, size_t size)
 	// pph.ts_secs = time(NULL); // Set the timestamp to the current time
 	// pph.ts_usecs = 0; // Set the microseconds to 0
 
-	timeval temp_time;
-
-	gettimeofday(&temp_time, NULL); // Get the current time
-	pph.ts_secs = temp_time.tv_sec; // Copy the timestamp from the original packet
-	pph.ts_usecs = temp_time.tv_usec; // Copy the microseconds from the original packet
+	loop_clock.reply_stamp(&pph.ts_secs, &pph.ts_usecs); // the loop's time, unless -P
 	
 	pph.caplen = sizeof(eth_hdr) + sizeof(IPv4) + sizeof(udp) + size; // Dynamically calculate the captured length, including the ICMP payload size
 	pph.len = pph.caplen; // Set the actual length to the captured length
 
-	if(twig_debug){
-		printf("sizeof(pcap_pkthdr): %zu\n", sizeof(pcap_pkthdr));
-		printf("sizeof(eth_hdr): %zu\n", sizeof(eth_hdr));
-		printf("sizeof(IPv4): %zu\n", sizeof(IPv4));
-		printf("sizeof(UDP): %zu\n", sizeof(UDP));
-	}
+	tlog<LOG_DEBUG>("sizeof(pcap_pkthdr): %zu\nsizeof(eth_hdr): %zu\nsizeof(IPv4): %zu\nsizeof(UDP): %zu\n",
+		sizeof(pcap_pkthdr), sizeof(eth_hdr), sizeof(IPv4), sizeof(UDP));
 
-	if(twig_debug || debug)
-	{
-		printf("### Sending UDP Reply ###\n");
-		print_ethernet(&packet->ehead); // Print the ethernet header for debugging
-		print_IPv4(&packet->ip); // Print the IPv4 header for debugging
-		print_UDP(&packet->udp); // Print the ICMP header for debugging
-		printf("Payload: ");
-		// Print the payload for debugging
-		for (size_t i = 0; i < size; i++) {
-			printf("%02x ", packet->payload[i]);
-		}
-		printf("\n Of size: %zu\n", size);
-		printf("Total size of packet: %u, versus predicted: %zu\n", pph.caplen, sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP) + size);
-	}
+	tlog<LOG_DEBUG>("### Sending UDP Reply ###\n");
+	print_ethernet<LOG_DEBUG>(&packet->ehead); // Print the ethernet header for debugging
+	print_IPv4<LOG_DEBUG>(&packet->ip); // Print the IPv4 header for debugging
+	print_UDP<LOG_DEBUG>(&packet->udp); // Print the ICMP header for debugging
+	tlog_hex<LOG_DEBUG>("Payload", payload, size); // copied, it's gone by the time this is printed
+	tlog<LOG_DEBUG>(" Of size: %zu\nTotal size of packet: %u, versus predicted: %zu\n", size, pph.caplen,
+		sizeof(eth_hdr) + sizeof(IPv4) + sizeof(ICMP) + size);
 
 	// Build the packet here
 	iovec out_packet[10];
@@ -773,16 +1035,40 @@ void build_and_send_UDP(UDP_packet *packet, size_t size)
 	out_packet[2].iov_len = sizeof(IPv4); // Correctly calculate the size of the IPv4 header
 	out_packet[3].iov_base = &packet->udp;
 	out_packet[3].iov_len = sizeof(UDP); // Correctly calculate the size of the ICMP header
-	out_packet[4].iov_base = packet->payload;
+	out_packet[4].iov_base = (void *)payload; // still sitting in the request
 	out_packet[4].iov_len = size; // Correctly calculate the size of the payload
 
-	// Send the out_packet here
-	if(writev(fd, out_packet, 5) == -1) // Correct the number of iovec elements to include ICMP
-	{
-		perror("writev failed");
-		free(packet);
-		exit(1);
+	// Queue the out_packet here, the batch writes it (and whatever else is waiting) in one writev
+	if (ifc->byteswap) { // the record header has to match the rest of the file
+		pph.ts_secs = byteswap32(pph.ts_secs);
+		pph.ts_usecs = byteswap32(pph.ts_usecs);
+		pph.caplen = byteswap32(pph.caplen);
+		pph.len = byteswap32(pph.len);
 	}
+	send_reply(ifc, pph, out_packet + 1, 4, (char *)packet, 0x11); // the headers (and maybe the payload) live in packet
 
 }
 
+char *reply_headers(Interface *ifc, char *record, size_t hdr_len)
+{
+	// The read() buffer is ours to scribble on, so replies are built right on top of the request.
+	// With -m the record is the read-only mapping of the capture file itself, so copy just the
+	// headers out to a pool buffer and let the payload stay in the mapping.
+	if (!ifc->use_mmap)
+		return record;
+
+	char *buf = ifc->pool.get();
+	memcpy(buf, record, hdr_len);
+	return buf;
+}
+
+size_t ip_payload_size(IPv4 *ip, size_t captured, size_t l4_hdr)
+{
+	// Short frames get padded out to 60 bytes on the wire, so trust the IP length over the
+	// capture length (otherwise the padding gets echoed back and the checksums stop matching)
+	size_t size = captured - sizeof(IPv4) - l4_hdr;
+	size_t ip_len = byteswap16(ip->len);
+	if (ip_len >= sizeof(IPv4) + l4_hdr && ip_len - sizeof(IPv4) - l4_hdr < size)
+		size = ip_len - sizeof(IPv4) - l4_hdr;
+	return size;
+}